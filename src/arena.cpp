@@ -0,0 +1,280 @@
+/*
+ * arena.cpp
+ *
+ * Arenas serving the buffers used while a level is processed.
+ * An arena is one region reserved at first use, backed by 1 GB or 2 MB huge pages
+ * where the system provides them, else by normal pages with transparent huge pages
+ * requested, else by malloc.
+ * Buffers are taken from an arena by moving a pointer and are all given back at
+ * once by returning to a mark, so the next level reuses the same, already mapped, memory.
+ *
+ * There is a default arena and one arena per NUMA node. A thread allocates from the
+ * arena of the node it has been bound to with arenaUseNode, else from the default one.
+ * A node arena is bound to its node's memory where the system allows it, and in any case
+ * is only used by threads pinned to the node, so its pages are first touched there and
+ * stay there when they are reused level after level.
+ *
+ * A function that takes buffers from an arena gives them back before it returns,
+ * by releasing the arena to a mark it took on entry. Only buffers handed back to
+ * the caller are left allocated, and they belong to the caller's mark.
+ */
+#include <iostream>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+using namespace std;
+
+/*
+ * Size of the region reserved for each arena, can be changed before its first use.
+ */
+size_t arenaReserve = (size_t)1 << 30;
+
+static const size_t arenaAlign = 64;
+static const size_t hugePageSize = (size_t)2 << 20;
+static const size_t gigaPageSize = (size_t)1 << 30;
+static const int maxNodeArenas = 8;
+
+struct arena {
+  int node; // NUMA node whose memory backs the arena, -1 for the default arena
+  volatile bool ready;
+  char * base;
+  size_t size;
+  volatile size_t used; // may go past size, the excess is served by malloc
+  volatile size_t peak;
+  const char * pages;
+  /*
+   * Allocations that did not fit in the arena, freed when the arena is released
+   * to a mark not above the position at which they were made. The list grows as needed.
+   */
+  void ** overflowBuffers;
+  size_t * overflowMarks;
+  int overflowCount;
+  int overflowCapacity;
+  pthread_mutex_t lock;
+};
+
+static arena defaultArena = { -1, false, NULL, 0, 0, 0, "", NULL, NULL, 0, 0, PTHREAD_MUTEX_INITIALIZER };
+static arena nodeArenas[maxNodeArenas];
+static int nodeArenaCount = 0;
+static pthread_mutex_t nodeArenasLock = PTHREAD_MUTEX_INITIALIZER;
+static __thread arena * threadArena = NULL;
+
+static size_t roundUp(size_t n, size_t to) {
+  return (n + to - 1) / to * to;
+}
+
+static void * mapRegion(size_t size, int flags) {
+  void * p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | flags, -1, 0);
+  return (p == MAP_FAILED) ? NULL : p;
+}
+
+/*
+ * Bind a region not yet touched to the memory of a node.
+ */
+static bool bindToNode(void * p, size_t size, int node) {
+#ifdef SYS_mbind
+  const int mpolBind = 2; // MPOL_BIND of <linux/mempolicy.h>
+  unsigned long mask[maxNodeArenas / (8 * sizeof(unsigned long)) + 1];
+  memset(mask, 0, sizeof(mask));
+  if (node < 0 || node >= (int)(8 * sizeof(mask)))
+    return false;
+  mask[node / (8 * sizeof(unsigned long))] |= 1UL << (node % (8 * sizeof(unsigned long)));
+  return syscall(SYS_mbind, p, size, mpolBind, mask, 8 * sizeof(mask), 0) == 0;
+#else
+  return false;
+#endif
+}
+
+static void arenaInit(arena * a) {
+  void * p = NULL;
+#if defined(MAP_HUGETLB) && defined(MAP_HUGE_1GB)
+  if (arenaReserve >= gigaPageSize) {
+    a->size = roundUp(arenaReserve, gigaPageSize);
+    p = mapRegion(a->size, MAP_HUGETLB | MAP_HUGE_1GB);
+    a->pages = "1 GB pages";
+  }
+#endif
+#ifdef MAP_HUGETLB
+  if (p == NULL) {
+    a->size = roundUp(arenaReserve, hugePageSize);
+    p = mapRegion(a->size, MAP_HUGETLB);
+    a->pages = "2 MB pages";
+  }
+#endif
+  if (p == NULL) {
+    a->size = roundUp(arenaReserve, hugePageSize);
+#ifdef MAP_NORESERVE
+    p = mapRegion(a->size, MAP_NORESERVE);
+#else
+    p = mapRegion(a->size, 0);
+#endif
+    a->pages = "normal pages";
+#ifdef MADV_HUGEPAGE
+    if (p != NULL && madvise(p, a->size, MADV_HUGEPAGE) == 0)
+      a->pages = "transparent huge pages";
+#endif
+  }
+  if (p != NULL && a->node >= 0 && !bindToNode(p, a->size, a->node))
+    cout << "arena of node " << a->node << " placed by first touch" << endl;
+  if (p == NULL) {
+    a->size = arenaReserve;
+    p = malloc(a->size);
+    a->pages = "malloc";
+  }
+  if (p == NULL) {
+    a->size = 0;
+    a->pages = "none";
+  }
+  a->base = (char *)p;
+}
+
+/*
+ * The arena of the calling thread, reserved at its first use.
+ */
+static arena * currentArena() {
+  arena * a = (threadArena != NULL) ? threadArena : &defaultArena;
+  if (!a->ready) {
+    pthread_mutex_lock(&a->lock);
+    if (!a->ready) {
+      arenaInit(a);
+      __sync_synchronize();
+      a->ready = true;
+    }
+    pthread_mutex_unlock(&a->lock);
+  }
+  return a;
+}
+
+/*
+ * Make the calling thread, which must be pinned to the processors of the node,
+ * allocate from the arena of a NUMA node; a negative node selects the default arena.
+ */
+void arenaUseNode(int node) {
+  if (node < 0) {
+    threadArena = NULL;
+    return;
+  }
+  pthread_mutex_lock(&nodeArenasLock);
+  arena * a = NULL;
+  for (int i = 0; i < nodeArenaCount && a == NULL; i++) {
+    if (nodeArenas[i].node == node)
+      a = &nodeArenas[i];
+  }
+  if (a == NULL && nodeArenaCount < maxNodeArenas) {
+    a = &nodeArenas[nodeArenaCount++];
+    memset(a, 0, sizeof(*a));
+    a->node = node;
+    a->pages = "";
+    pthread_mutex_init(&a->lock, NULL);
+  }
+  pthread_mutex_unlock(&nodeArenasLock);
+  threadArena = a;
+}
+
+/*
+ * The node whose arena the calling thread allocates from, -1 for the default arena.
+ * Threads created by a node's thread call arenaUseNode with it.
+ */
+int arenaNode() {
+  return (threadArena != NULL) ? threadArena->node : -1;
+}
+
+static void notePeak(arena * a, size_t used) {
+  size_t peak = a->peak;
+  while (used > peak && !__sync_bool_compare_and_swap(&a->peak, peak, used))
+    peak = a->peak;
+}
+
+/*
+ * Return a buffer of at least 'bytes' bytes, aligned to a cache line, from the
+ * arena of the calling thread.
+ * It stays valid until the arena is released to a mark taken before this call.
+ * Safe to call from several threads at once.
+ * The run is stopped if the memory cannot be found.
+ */
+void * arenaAlloc(size_t bytes) {
+  arena * a = currentArena();
+  size_t n = roundUp(bytes, arenaAlign);
+  size_t at = __sync_fetch_and_add(&a->used, n);
+  notePeak(a, at + n);
+  if (at + n <= a->size)
+    return a->base + at;
+  void * p = malloc(bytes);
+  pthread_mutex_lock(&a->lock);
+  if (p != NULL && a->overflowCount == a->overflowCapacity) {
+    int capacity = 2 * a->overflowCapacity + 16;
+    void ** buffers = (void **)realloc(a->overflowBuffers, capacity * sizeof(void *));
+    if (buffers != NULL)
+      a->overflowBuffers = buffers;
+    size_t * marks = (size_t *)realloc(a->overflowMarks, capacity * sizeof(size_t));
+    if (marks != NULL)
+      a->overflowMarks = marks;
+    if (buffers != NULL && marks != NULL)
+      a->overflowCapacity = capacity;
+  }
+  if (p == NULL || a->overflowCount == a->overflowCapacity) {
+    pthread_mutex_unlock(&a->lock);
+    cout << "out of memory for a buffer of " << bytes << " bytes" << endl;
+    abort();
+  }
+  a->overflowBuffers[a->overflowCount] = p;
+  a->overflowMarks[a->overflowCount] = at;
+  a->overflowCount++;
+  pthread_mutex_unlock(&a->lock);
+  return p;
+}
+
+/*
+ * Return the current position of the arena of the calling thread,
+ * to be passed later to arenaRelease.
+ */
+size_t arenaMark() {
+  return currentArena()->used;
+}
+
+/*
+ * Give back all the buffers taken from the arena of the calling thread since 'mark'.
+ * Must only be called when no other thread is using that arena.
+ */
+void arenaRelease(size_t mark) {
+  arena * a = currentArena();
+  pthread_mutex_lock(&a->lock);
+  int kept = 0;
+  for (int i = 0; i < a->overflowCount; i++) {
+    if (a->overflowMarks[i] >= mark) {
+      free(a->overflowBuffers[i]);
+    } else {
+      a->overflowBuffers[kept] = a->overflowBuffers[i];
+      a->overflowMarks[kept] = a->overflowMarks[i];
+      kept++;
+    }
+  }
+  a->overflowCount = kept;
+  pthread_mutex_unlock(&a->lock);
+  if (mark < a->used)
+    a->used = mark;
+}
+
+static void reportArena(const arena * a) {
+  if (!a->ready)
+    return;
+  cout << "Arena";
+  if (a->node >= 0)
+    cout << " of node " << a->node;
+  cout << ": current " << a->used / 1024 << " KB, peak " << a->peak / 1024 << " KB of "
+      << a->size / (1024 * 1024) << " MB (" << a->pages << ")" << endl;
+}
+
+/*
+ * Show the current and peak usage of the arenas.
+ */
+void arenaReport() {
+  reportArena(&defaultArena);
+  for (int i = 0; i < nodeArenaCount; i++)
+    reportArena(&nodeArenas[i]);
+}
@@ -0,0 +1,380 @@
+/*
+ * batchSolver.cpp
+ *
+ * Forward expansion of many start positions together.
+ * The levels of a batch hold tagged records: a position and a 64-bit mask with
+ * bit j set if the position is reachable from start j.
+ * A position reachable from several starts is stored, sorted and expanded once,
+ * with the masks of its copies OR-ed together.
+ * Each level is then split into the ordinary level files of each job, named with
+ * the job's prefix, so jobs never overwrite each other's files.
+ * The tagged files and the sorted runs are named after the process, so that
+ * several batch runs can share a directory.
+ */
+#include <iostream>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <algorithm>
+#include "codedMove.h"
+using namespace std;
+
+extern const char * modeCreateWriteBinary;
+extern const char * modeOpenReadBinary;
+extern char * getPrefixedName(const char * prefix, int level, bool centreHoleFull, bool isTrimmed);
+extern bool checkLevelFileBounds(const char * fileName, int level, bool full);
+struct levelSums;
+extern levelSums * startLevelSums();
+extern void addLevelSums(levelSums * s, const uint32_t * values, uint32_t n);
+extern void finishLevelSums(levelSums * s, const char * fileName);
+extern void prepareAllMoves();
+extern void * arenaAlloc(size_t bytes);
+extern size_t arenaMark();
+extern void arenaRelease(size_t mark);
+extern void startTime();
+extern void showTime();
+
+static const int NO_OF_HOLES = 33;
+static const int maxMoves = 128;
+
+/*
+ * Number of starts sharing one batch: one per bit of the record mask, so that
+ * the 33 boards with a single empty hole share a single batch.
+ */
+static const int maxBatchJobs = 64;
+
+static const uint32_t batchRunSize = 1 << 21; // records sorted in memory at a time
+static const uint32_t batchReadSize = 1 << 12; // records read at a time from each run while merging
+static const int maxBatchRuns = 256;
+static const int batchNameSize = 64;
+
+struct taggedRecord {
+  uint32_t pos;
+  uint32_t unused; // always 0, so that no undefined bytes are written
+  uint64_t jobs;
+};
+
+static bool byPosition(const taggedRecord & a, const taggedRecord & b) {
+  return a.pos < b.pos;
+}
+
+/*
+ * One half of the level being built: the records not yet sorted, and the
+ * sorted runs already written.
+ */
+struct batchHalf {
+  bool full;
+  taggedRecord * buf;
+  uint32_t count;
+  char runNames[maxBatchRuns][batchNameSize];
+  int nRuns;
+  int runsWritten; // to number the runs
+  uint64_t generated;
+};
+
+/*
+ * Start of the names of the tagged files, runs and job levels of this process.
+ */
+static char batchRunPrefix[24] = "";
+
+static coded_move batchMoves[2][maxMoves];
+static int nBatchMoves[2];
+static int nBatchCentre[2];
+
+static taggedRecord tagRecord(uint32_t pos, uint64_t jobs) {
+  taggedRecord r = {pos, 0, jobs};
+  return r;
+}
+
+/*
+ * Name of the tagged file of a level of the batch.
+ */
+static char * getBatchName(int batch, int level, bool full) {
+  static char buf[batchNameSize];
+  snprintf(buf, sizeof(buf), "%s.%d%c%02d.tag", batchRunPrefix, batch, full ? 'F' : 'E', level);
+  return buf;
+}
+
+/*
+ * Sort the records of a buffer, keep one record per position with the OR of
+ * the masks of its copies, and return the number of records kept.
+ */
+static uint32_t sortTagged(taggedRecord * buf, uint32_t n) {
+  sort(buf, buf + n, byPosition);
+  uint32_t w = 0;
+  for (uint32_t r = 0; r < n; r++) {
+    if (w > 0 && buf[w - 1].pos == buf[r].pos)
+      buf[w - 1].jobs |= buf[r].jobs;
+    else
+      buf[w++] = buf[r];
+  }
+  return w;
+}
+
+static void nameRun(batchHalf * h, char * name) {
+  snprintf(name, batchNameSize, "%s.%c%d.run", batchRunPrefix, h->full ? 'F' : 'E', h->runsWritten);
+  h->runsWritten++;
+}
+
+static void mergeRuns(batchHalf * h, const char * outName, int firstJob, int nJobs, int level, bool full,
+    uint32_t * jobCounts, uint32_t * unique);
+
+/*
+ * Write the buffered records of a half level as a sorted run.
+ * When there are too many runs they are first merged into one.
+ */
+static void flushRun(batchHalf * h) {
+  if (h->count == 0)
+    return;
+  uint32_t n = sortTagged(h->buf, h->count);
+  nameRun(h, h->runNames[h->nRuns]);
+  FILE * f = fopen(h->runNames[h->nRuns], modeCreateWriteBinary);
+  fwrite(h->buf, sizeof(taggedRecord), n, f);
+  fclose(f);
+  h->nRuns++;
+  h->count = 0;
+  if (h->nRuns == maxBatchRuns) {
+    char tempName[batchNameSize];
+    uint32_t unique;
+    nameRun(h, tempName);
+    mergeRuns(h, tempName, 0, 0, 0, false, NULL, &unique);
+    memcpy(h->runNames[0], tempName, batchNameSize);
+    h->nRuns = 1;
+  }
+}
+
+static void addRecord(batchHalf * h, taggedRecord record) {
+  if (h->count == batchRunSize)
+    flushRun(h);
+  h->buf[h->count++] = record;
+  h->generated++;
+}
+
+/*
+ * Buffered reader of a sorted run.
+ */
+struct runReader {
+  FILE * f;
+  taggedRecord * buf;
+  uint32_t at;
+  uint32_t count;
+};
+
+static bool nextRecord(runReader * r, taggedRecord * record) {
+  if (r->at == r->count) {
+    r->count = fread(r->buf, sizeof(taggedRecord), batchReadSize, r->f);
+    r->at = 0;
+    if (r->count == 0)
+      return false;
+  }
+  *record = r->buf[r->at++];
+  return true;
+}
+
+/*
+ * Merge the sorted runs of a half level into outName, OR-ing the masks of equal positions,
+ * and remove the runs.
+ * If nJobs is not 0 the positions of each job are also written to the job's own level file,
+ * counted in jobCounts and checked.
+ */
+static void mergeRuns(batchHalf * h, const char * outName, int firstJob, int nJobs, int level, bool full,
+    uint32_t * jobCounts, uint32_t * unique) {
+  size_t mark = arenaMark();
+  runReader * readers = (runReader *)arenaAlloc(h->nRuns * sizeof(runReader));
+  taggedRecord * heads = (taggedRecord *)arenaAlloc(h->nRuns * sizeof(taggedRecord));
+  bool * live = (bool *)arenaAlloc(h->nRuns * sizeof(bool));
+  for (int k = 0; k < h->nRuns; k++) {
+    readers[k].f = fopen(h->runNames[k], modeOpenReadBinary);
+    readers[k].buf = (taggedRecord *)arenaAlloc(batchReadSize * sizeof(taggedRecord));
+    readers[k].at = readers[k].count = 0;
+    live[k] = nextRecord(&readers[k], &heads[k]);
+  }
+  FILE * jobFiles[maxBatchJobs];
+  levelSums * jobSums[maxBatchJobs];
+  char (* jobNames)[batchNameSize] = (char (*)[batchNameSize])arenaAlloc((nJobs + 1) * batchNameSize);
+  for (int j = 0; j < nJobs; j++) {
+    char prefix[sizeof(batchRunPrefix) + 16];
+    snprintf(prefix, sizeof(prefix), "%sj%02d", batchRunPrefix, firstJob + j);
+    snprintf(jobNames[j], batchNameSize, "%s", getPrefixedName(prefix, level, full, false));
+    jobFiles[j] = fopen(jobNames[j], modeCreateWriteBinary);
+    jobSums[j] = startLevelSums();
+  }
+  FILE * fw = fopen(outName, modeCreateWriteBinary);
+  taggedRecord * wbuf = h->buf; // the records of the half level are all in the runs by now
+  if (nJobs > 0)
+    memset(jobCounts, 0, nJobs * sizeof(uint32_t));
+  uint32_t wc = 0;
+  *unique = 0;
+  while (1) {
+    int m = -1;
+    for (int k = 0; k < h->nRuns; k++) {
+      if (live[k] && (m < 0 || heads[k].pos < heads[m].pos))
+        m = k;
+    }
+    if (m < 0)
+      break;
+    taggedRecord record = heads[m];
+    live[m] = nextRecord(&readers[m], &heads[m]);
+    if (wc > 0 && wbuf[wc - 1].pos == record.pos) {
+      wbuf[wc - 1].jobs |= record.jobs;
+      continue;
+    }
+    if (wc == batchRunSize) {
+      // the last record may still gain jobs, keep it
+      fwrite(wbuf, sizeof(taggedRecord), wc - 1, fw);
+      wbuf[0] = wbuf[wc - 1];
+      wc = 1;
+    }
+    wbuf[wc++] = record;
+    (*unique)++;
+    if (nJobs > 0 && wc > 1) {
+      uint32_t pos = wbuf[wc - 2].pos;
+      uint64_t jobs = wbuf[wc - 2].jobs;
+      for (int j = 0; j < nJobs; j++) {
+        if (jobs & ((uint64_t)1 << j)) {
+          fwrite(&pos, sizeof(uint32_t), 1, jobFiles[j]);
+          addLevelSums(jobSums[j], &pos, 1);
+          jobCounts[j]++;
+        }
+      }
+    }
+  }
+  if (nJobs > 0 && wc > 0) {
+    uint32_t pos = wbuf[wc - 1].pos;
+    uint64_t jobs = wbuf[wc - 1].jobs;
+    for (int j = 0; j < nJobs; j++) {
+      if (jobs & ((uint64_t)1 << j)) {
+        fwrite(&pos, sizeof(uint32_t), 1, jobFiles[j]);
+        addLevelSums(jobSums[j], &pos, 1);
+        jobCounts[j]++;
+      }
+    }
+  }
+  fwrite(wbuf, sizeof(taggedRecord), wc, fw);
+  fclose(fw);
+  for (int j = 0; j < nJobs; j++) {
+    fclose(jobFiles[j]);
+    finishLevelSums(jobSums[j], jobNames[j]);
+    if (!checkLevelFileBounds(jobNames[j], level, full))
+      cout << "job " << firstJob + j << " level " << level << " is damaged" << endl;
+  }
+  for (int k = 0; k < h->nRuns; k++) {
+    fclose(readers[k].f);
+    remove(h->runNames[k]);
+  }
+  h->nRuns = 0;
+  arenaRelease(mark);
+}
+
+/*
+ * Expand the tagged records of one half of a level into the halves of the next level.
+ */
+static void expandTaggedHalf(FILE * f, bool full, batchHalf * next) {
+  size_t mark = arenaMark();
+  taggedRecord * rbuf = (taggedRecord *)arenaAlloc(batchReadSize * sizeof(taggedRecord));
+  const coded_move * cm = batchMoves[full];
+  int n = nBatchMoves[full];
+  int firstCentre = n - nBatchCentre[full];
+  while (1) {
+    uint32_t rc = fread(rbuf, sizeof(taggedRecord), batchReadSize, f);
+    if (rc == 0)
+      break;
+    for (uint32_t r = 0; r < rc; r++) {
+      uint32_t pos = rbuf[r].pos;
+      uint64_t jobs = rbuf[r].jobs;
+      for (int i = 0; i < n; i++) {
+        if ((pos & cm[i].mask) == cm[i].match)
+          addRecord(&next[full ^ (i >= firstCentre)], tagRecord(pos ^ cm[i].mask, jobs));
+      }
+    }
+  }
+  arenaRelease(mark);
+}
+
+static int levelOf(uint32_t pos, bool full) {
+  return NO_OF_HOLES - __builtin_popcount(pos) - (full ? 1 : 0);
+}
+
+/*
+ * Expand a batch of at most maxBatchJobs starts, numbered from firstJob, up to finalLevel.
+ * Each start joins the batch at its own level.
+ * Add to shared the number of positions of the batch levels, and to perJob the number
+ * of positions the jobs would have had on their own.
+ */
+static void solveBatchGroup(int batch, const uint32_t * starts, const bool * startsFull, int firstJob, int nJobs,
+    int finalLevel, bool show, uint64_t * shared, uint64_t * perJob) {
+  int firstLevel = NO_OF_HOLES;
+  for (int j = 0; j < nJobs; j++)
+    firstLevel = min(firstLevel, levelOf(starts[j], startsFull[j]));
+  size_t mark = arenaMark();
+  batchHalf * halves = (batchHalf *)arenaAlloc(2 * sizeof(batchHalf));
+  for (int full = 0; full < 2; full++) {
+    halves[full].buf = (taggedRecord *)arenaAlloc(batchRunSize * sizeof(taggedRecord));
+    halves[full].full = full;
+    halves[full].count = 0;
+    halves[full].nRuns = 0;
+    halves[full].runsWritten = 0;
+  }
+  uint32_t jobCounts[2][maxBatchJobs];
+  for (int level = firstLevel; level <= finalLevel; level++) {
+    halves[0].generated = halves[1].generated = 0;
+    if (level > firstLevel) {
+      for (int full = 0; full < 2; full++) {
+        FILE * f = fopen(getBatchName(batch, level - 1, full), modeOpenReadBinary);
+        expandTaggedHalf(f, full, halves);
+        fclose(f);
+        remove(getBatchName(batch, level - 1, full));
+      }
+    }
+    for (int j = 0; j < nJobs; j++) {
+      if (levelOf(starts[j], startsFull[j]) == level)
+        addRecord(&halves[startsFull[j]], tagRecord(starts[j], (uint64_t)1 << j));
+    }
+    uint32_t unique[2];
+    uint64_t separate = 0;
+    for (int full = 0; full < 2; full++) {
+      flushRun(&halves[full]);
+      mergeRuns(&halves[full], getBatchName(batch, level, full), firstJob, nJobs, level, full, jobCounts[full],
+          &unique[full]);
+      for (int j = 0; j < nJobs; j++)
+        separate += jobCounts[full][j];
+    }
+    *shared += unique[0] + unique[1];
+    *perJob += separate;
+    showTime();
+    cout << "Batch " << batch << " level " << level << ": " << halves[0].generated + halves[1].generated
+        << " generated, " << unique[0] + unique[1] << " shared positions for " << separate << " job positions" << endl;
+    if (show) {
+      for (int j = 0; j < nJobs; j++)
+        cout << "  job " << firstJob + j << ": " << jobCounts[0][j] + jobCounts[1][j] << endl;
+    }
+  }
+  remove(getBatchName(batch, finalLevel, false));
+  remove(getBatchName(batch, finalLevel, true));
+  arenaRelease(mark);
+}
+
+/*
+ * Expand many start positions up to finalLevel, in batches of maxBatchJobs starts.
+ * The levels of start j are written to the level files prefixed "batch<pid>jNN",
+ * so that batches run at the same time do not overwrite each other's.
+ */
+void solveBatch(const uint32_t * starts, const bool * startsFull, int n, int finalLevel, bool show) {
+  prepareAllMoves();
+  for (int full = 0; full < 2; full++)
+    nBatchMoves[full] = getCodedMoves(full, batchMoves[full], &nBatchCentre[full]);
+  snprintf(batchRunPrefix, sizeof(batchRunPrefix), "batch%ld", (long)getpid());
+  startTime();
+  cout << "Levels of start j are written to the files prefixed " << batchRunPrefix << "jNN" << endl;
+  uint64_t shared = 0;
+  uint64_t perJob = 0;
+  for (int first = 0; first < n; first += maxBatchJobs) {
+    int nJobs = min(n - first, maxBatchJobs);
+    solveBatchGroup(first / maxBatchJobs, starts + first, startsFull + first, first, nJobs, finalLevel, show,
+        &shared, &perJob);
+  }
+  showTime();
+  cout << n << " starts: " << shared << " shared positions instead of " << perJob << endl;
+}
@@ -0,0 +1,37 @@
+/*
+ * codedMove.h
+ *
+ * The coded form of a move, shared by the level engine and the solvers.
+ */
+#ifndef CODEDMOVE_H_
+#define CODEDMOVE_H_
+
+#include <stdint.h>
+
+/*
+ * In a coded move each peg position is represented by a bit in a 32-bit word.
+ * The bit position is the given by the peg number in the 'positions' array
+ * The mask has a 1 in the 'from', 'middle' and 'to' positions of the move.
+ * The match has a 1 in the 'from' and 'middle' position of the move.
+ * The move is possible if of masking the board status with the mask the
+ * result is the match.
+ * Executing the move is equivalent to XOR-in the coded board status with the
+ * mask.
+ * The word that represents the board status has 32 bits, hence it can represent
+ * only holes 0-31. Hole 32 is represented separately to avoid having to use
+ * 64 bits to represent the board status.
+ * TODO: would a 64-bit representation be faster?
+ */
+struct coded_move {
+  uint32_t mask;
+  uint32_t match;
+};
+
+/*
+ * Copy into cm the moves that can be played on a position with the centre hole
+ * full or empty: first the normal moves, then the *nCentre moves that change the
+ * centre hole. Return the total number of moves.
+ */
+int getCodedMoves(bool full, coded_move * cm, int * nCentre);
+
+#endif /* CODEDMOVE_H_ */
@@ -0,0 +1,455 @@
+/*
+ * dfsSolver.cpp
+ *
+ * Depth-first search for one solution from a given position, as an alternative
+ * to the breadth-first level engine when the set of all reachable positions is
+ * not needed.
+ * Positions found not to lead to a target are remembered in a fixed-size table
+ * shared without locks by all the threads, each of which searches a part of the
+ * positions a few moves away from the start.
+ * Positions that no pagoda function allows to reach a target are not searched,
+ * and a start whose position class differs from that of every target is given up
+ * at once. The search also gives up when its time budget runs out.
+ */
+#include <iostream>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include "codedMove.h"
+using namespace std;
+
+extern void prepareAllMoves();
+extern int getThreadCount();
+extern void * arenaAlloc(size_t bytes);
+extern size_t arenaMark();
+extern void arenaRelease(size_t mark);
+extern void showPosition(uint32_t pos, bool full);
+extern void preparePruning(const uint32_t * targets, const bool * targetsFull, int nTargets);
+extern bool canReachTargets(uint32_t pos, bool full);
+extern int nPagodas;
+extern int positions[7][7];
+
+static const int NO_OF_HOLES = 33;
+static const int maxMoves = 128;
+static const int maxDepth = 34;
+
+/*
+ * Moves playable with the centre hole empty [0] or full [1].
+ * flips is 1 for the moves that change the centre hole.
+ */
+struct dfsMove {
+  uint32_t mask;
+  uint32_t match;
+  int flips;
+};
+
+static dfsMove dfsMoves[2][maxMoves];
+static int nDfsMoves[2];
+
+/*
+ * Targets: either any position with a single peg, or a list of positions.
+ */
+static const int maxTargets = 64;
+static bool anySinglePeg = true;
+static uint32_t targetPositions[maxTargets];
+static bool targetFull[maxTargets];
+static int nTargets = 0;
+static int targetPegs = 1;
+static bool targetsSymmetric = true;
+
+/*
+ * Table of dead positions: open addressing on 64-bit keys, each key being
+ * the position, the centre hole in bit 32 and a 1 in bit 33 so no key is 0.
+ * An insertion that finds no free slot within dfsProbes slots is dropped, so the
+ * table never grows. 2^24 entries, 128 MB, hold enough of the dead positions
+ * for a search towards a single target away from the centre.
+ */
+int deadTableBits = 24;
+static const int dfsProbes = 16;
+static volatile uint64_t * deadTable;
+static uint64_t deadTableMask;
+
+/*
+ * Seconds the search may take, 0 for no limit.
+ */
+double dfsTimeBudget = 300;
+static const uint32_t dfsClockEvery = 1 << 16; // positions searched between looks at the clock
+
+static volatile int solved;
+static volatile int stopped; // set when a solution is found or the time budget runs out
+static volatile int gaveUp;
+static double dfsDeadline;
+static uint32_t solution[maxDepth];
+static bool solutionFull[maxDepth];
+static int solutionLength;
+
+static int pegCount(uint32_t pos, bool full) {
+  return __builtin_popcount(pos) + (full ? 1 : 0);
+}
+
+static uint32_t rotate(uint32_t pos, int bits) {
+  return (pos << bits) | (pos >> (32 - bits));
+}
+
+static double wallClock() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/*
+ * Position class by the rule of three: colour the holes by (row + column) mod 3,
+ * and again by (row - column) mod 3. Every move takes a peg from two holes of
+ * different colours and puts one in the third colour, flipping the parity of the
+ * count of pegs of all three colours, so for each colouring whether the counts of
+ * two colours have the same parity never changes. The four such bits are the class
+ * of a position, and no sequence of moves leads to a position of another class.
+ */
+static uint32_t classMasks[2][3];
+static int centreColour[2];
+
+static void prepareClassMasks() {
+  memset(classMasks, 0, sizeof(classMasks));
+  // the centre hole, at (3, 3), is not in positions
+  centreColour[0] = (3 + 3) % 3;
+  centreColour[1] = (3 - 3 + 6) % 3;
+  for (int i = 0; i < 7; i++) {
+    for (int j = 0; j < 7; j++) {
+      int h = positions[i][j];
+      if (h < 0)
+        continue;
+      int colour[2] = {(i + j) % 3, (i - j + 6) % 3};
+      for (int k = 0; k < 2; k++)
+        classMasks[k][colour[k]] |= 1u << h;
+    }
+  }
+}
+
+static int positionClass(uint32_t pos, bool full) {
+  int c = 0;
+  for (int k = 0; k < 2; k++) {
+    int parity[3];
+    for (int colour = 0; colour < 3; colour++)
+      parity[colour] = (__builtin_popcount(pos & classMasks[k][colour]) + (full && centreColour[k] == colour)) & 1;
+    c |= ((parity[0] ^ parity[1]) | ((parity[1] ^ parity[2]) << 1)) << (2 * k);
+  }
+  return c;
+}
+
+/*
+ * Adding 8 modulo 32 to the hole numbers rotates the board by 90 degrees,
+ * so when the targets are invariant by rotation the four rotations of a
+ * position are either all dead or all alive, and share one entry.
+ */
+static uint64_t deadKey(uint32_t pos, bool full) {
+  uint32_t k = pos;
+  if (targetsSymmetric) {
+    for (int r = 8; r < 32; r += 8) {
+      uint32_t rp = rotate(pos, r);
+      if (rp < k)
+        k = rp;
+    }
+  }
+  return (uint64_t)k | ((uint64_t)(full ? 1 : 0) << 32) | ((uint64_t)1 << 33);
+}
+
+static uint64_t hashKey(uint64_t key) {
+  key ^= key >> 29;
+  key *= 0xbf58476d1ce4e5b9ULL;
+  key ^= key >> 32;
+  return key;
+}
+
+static bool isDead(uint64_t key) {
+  uint64_t h = hashKey(key);
+  for (int i = 0; i < dfsProbes; i++) {
+    uint64_t k = deadTable[(h + i) & deadTableMask];
+    if (k == key)
+      return true;
+    if (k == 0)
+      return false;
+  }
+  return false;
+}
+
+static void markDead(uint64_t key) {
+  uint64_t h = hashKey(key);
+  for (int i = 0; i < dfsProbes; i++) {
+    volatile uint64_t * slot = &deadTable[(h + i) & deadTableMask];
+    uint64_t k = *slot;
+    if (k == key)
+      return;
+    if (k == 0 && __sync_bool_compare_and_swap(slot, (uint64_t)0, key))
+      return;
+    if (*slot == key)
+      return;
+  }
+}
+
+static bool isTarget(uint32_t pos, bool full) {
+  if (anySinglePeg)
+    return pegCount(pos, full) == 1;
+  for (int i = 0; i < nTargets; i++) {
+    if (targetPositions[i] == pos && targetFull[i] == full)
+      return true;
+  }
+  return false;
+}
+
+/*
+ * Each worker keeps the positions from the start to the current one.
+ */
+struct dfsWorker {
+  uint32_t path[maxDepth];
+  bool pathFull[maxDepth];
+  uint64_t nodes;
+};
+
+static bool search(dfsWorker * w, int depth) {
+  uint32_t pos = w->path[depth];
+  bool full = w->pathFull[depth];
+  if (++w->nodes % dfsClockEvery == 0 && dfsTimeBudget > 0 && wallClock() > dfsDeadline) {
+    gaveUp = 1;
+    stopped = 1;
+  }
+  if (isTarget(pos, full)) {
+    if (__sync_bool_compare_and_swap(&solved, 0, 1)) {
+      stopped = 1;
+      memcpy(solution, w->path, (depth + 1) * sizeof(uint32_t));
+      memcpy(solutionFull, w->pathFull, (depth + 1) * sizeof(bool));
+      solutionLength = depth + 1;
+    }
+    return true;
+  }
+  if (pegCount(pos, full) <= targetPegs || depth + 1 >= maxDepth)
+    return false;
+  if (nPagodas > 0 && !canReachTargets(pos, full))
+    return false;
+  uint64_t key = deadKey(pos, full);
+  if (isDead(key))
+    return false;
+  const dfsMove * m = dfsMoves[full];
+  int n = nDfsMoves[full];
+  for (int i = 0; i < n && !stopped; i++) {
+    if ((pos & m[i].mask) == m[i].match) {
+      w->path[depth + 1] = pos ^ m[i].mask;
+      w->pathFull[depth + 1] = full ^ m[i].flips;
+      if (search(w, depth + 1))
+        return true;
+    }
+  }
+  if (!stopped)
+    markDead(key); // a search cut short by another thread or by the clock proves nothing
+  return false;
+}
+
+/*
+ * The positions a few moves from the start, shared out among the threads.
+ */
+struct rootPosition {
+  uint32_t path[maxDepth];
+  bool pathFull[maxDepth];
+};
+
+static rootPosition * roots;
+static int nRoots;
+static int rootDepth;
+static volatile int nextRoot;
+
+static void * searchRoots(void * arg) {
+  dfsWorker * w = (dfsWorker *)arg;
+  while (!stopped) {
+    int r = __sync_fetch_and_add(&nextRoot, 1);
+    if (r >= nRoots)
+      break;
+    memcpy(w->path, roots[r].path, (rootDepth + 1) * sizeof(uint32_t));
+    memcpy(w->pathFull, roots[r].pathFull, (rootDepth + 1) * sizeof(bool));
+    search(w, rootDepth);
+  }
+  return NULL;
+}
+
+static void prepareDfsMoves() {
+  prepareAllMoves();
+  for (int full = 0; full < 2; full++) {
+    coded_move cm[maxMoves];
+    int nCentre;
+    int n = getCodedMoves(full, cm, &nCentre);
+    for (int i = 0; i < n; i++) {
+      dfsMoves[full][i].mask = cm[i].mask;
+      dfsMoves[full][i].match = cm[i].match;
+      dfsMoves[full][i].flips = (i >= n - nCentre) ? 1 : 0;
+    }
+    nDfsMoves[full] = n;
+  }
+}
+
+/*
+ * Expand the start breadth first until there are enough positions to keep
+ * all threads busy, or the start has no successors left to split.
+ */
+static void splitRoots(uint32_t start, bool startFull, int nThreads) {
+  const int maxRoots = 4096;
+  roots = (rootPosition *)arenaAlloc(2 * maxRoots * sizeof(rootPosition));
+  rootPosition * next = roots + maxRoots;
+  roots[0].path[0] = start;
+  roots[0].pathFull[0] = startFull;
+  nRoots = 1;
+  rootDepth = 0;
+  while (nRoots < 8 * nThreads && rootDepth < 4) {
+    int nNext = 0;
+    for (int r = 0; r < nRoots; r++) {
+      uint32_t pos = roots[r].path[rootDepth];
+      bool full = roots[r].pathFull[rootDepth];
+      if (isTarget(pos, full))
+        return;
+      const dfsMove * m = dfsMoves[full];
+      for (int i = 0; i < nDfsMoves[full]; i++)
+        nNext += ((pos & m[i].mask) == m[i].match);
+    }
+    if (nNext == 0 || nNext > maxRoots)
+      return;
+    nNext = 0;
+    for (int r = 0; r < nRoots; r++) {
+      uint32_t pos = roots[r].path[rootDepth];
+      bool full = roots[r].pathFull[rootDepth];
+      const dfsMove * m = dfsMoves[full];
+      for (int i = 0; i < nDfsMoves[full]; i++) {
+        if ((pos & m[i].mask) == m[i].match) {
+          next[nNext] = roots[r];
+          next[nNext].path[rootDepth + 1] = pos ^ m[i].mask;
+          next[nNext].pathFull[rootDepth + 1] = full ^ m[i].flips;
+          nNext++;
+        }
+      }
+    }
+    rootPosition * t = roots; roots = next; next = t;
+    nRoots = nNext;
+    rootDepth++;
+  }
+}
+
+/*
+ * Choose the targets of the search: any single peg, or the given positions.
+ */
+void setDfsTargets(bool anySingle, const uint32_t * positions, const bool * full, int n) {
+  anySinglePeg = anySingle;
+  nTargets = (n < maxTargets) ? n : maxTargets;
+  targetPegs = 1;
+  targetsSymmetric = true;
+  if (anySingle)
+    return;
+  for (int i = 0; i < nTargets; i++) {
+    targetPositions[i] = positions[i];
+    targetFull[i] = full[i];
+  }
+  targetPegs = 33;
+  for (int i = 0; i < nTargets; i++) {
+    if (pegCount(targetPositions[i], targetFull[i]) < targetPegs)
+      targetPegs = pegCount(targetPositions[i], targetFull[i]);
+    for (int r = 8; r < 32; r += 8) {
+      bool found = false;
+      for (int j = 0; j < nTargets && !found; j++)
+        found = (targetPositions[j] == rotate(targetPositions[i], r) && targetFull[j] == targetFull[i]);
+      targetsSymmetric = targetsSymmetric && found;
+    }
+  }
+}
+
+/*
+ * Check the start against the position classes of the targets, and prepare the
+ * pagoda functions that separate positions from the targets.
+ * Return false if no target is in the class of the start.
+ */
+static bool preparePruningTo(uint32_t start, bool startFull) {
+  prepareClassMasks();
+  uint32_t singles[NO_OF_HOLES];
+  bool singlesFull[NO_OF_HOLES];
+  const uint32_t * targets = targetPositions;
+  const bool * targetsFull = targetFull;
+  int n = nTargets;
+  if (anySinglePeg) {
+    for (int h = 0; h < NO_OF_HOLES; h++) {
+      singles[h] = (h < 32) ? 1u << h : 0;
+      singlesFull[h] = (h == 32);
+    }
+    targets = singles;
+    targetsFull = singlesFull;
+    n = NO_OF_HOLES;
+  }
+  bool sameClass = false;
+  for (int i = 0; i < n && !sameClass; i++)
+    sameClass = (positionClass(targets[i], targetsFull[i]) == positionClass(start, startFull));
+  preparePruning(targets, targetsFull, n);
+  return sameClass;
+}
+
+/*
+ * Search for a sequence of moves from the start position to one of the targets,
+ * and show it. Return true if one is found.
+ * The search gives up, returning false, after dfsTimeBudget seconds.
+ */
+bool solveDepthFirst(uint32_t start, bool startFull, bool show) {
+  struct timeval t0, t1;
+  gettimeofday(&t0, NULL);
+  prepareDfsMoves();
+  if (!preparePruningTo(start, startFull)) {
+    preparePruning(NULL, NULL, 0);
+    cout << "No solution: no target is in the position class of the start" << endl;
+    return false;
+  }
+  if (!canReachTargets(start, startFull)) {
+    preparePruning(NULL, NULL, 0);
+    cout << "No solution: a pagoda function rules out the targets from the start" << endl;
+    return false;
+  }
+  dfsDeadline = wallClock() + dfsTimeBudget;
+  gaveUp = 0;
+  stopped = 0;
+  size_t mark = arenaMark();
+  deadTableMask = ((uint64_t)1 << deadTableBits) - 1;
+  deadTable = (volatile uint64_t *)arenaAlloc((deadTableMask + 1) * sizeof(uint64_t));
+  memset((void *)deadTable, 0, (deadTableMask + 1) * sizeof(uint64_t));
+  solved = 0;
+  solutionLength = 0;
+  int nThreads = getThreadCount();
+  uint64_t nodes = 0;
+  if (isTarget(start, startFull)) { // nothing to search, so no worker races to the solution
+    solved = 1;
+    solution[0] = start;
+    solutionFull[0] = startFull;
+    solutionLength = 1;
+  } else {
+    splitRoots(start, startFull, nThreads);
+    nextRoot = 0;
+    dfsWorker * workers = (dfsWorker *)arenaAlloc(nThreads * sizeof(dfsWorker));
+    pthread_t threads[64];
+    for (int i = 0; i < nThreads; i++) {
+      workers[i].nodes = 0;
+      if (i > 0)
+        pthread_create(&threads[i], NULL, searchRoots, &workers[i]);
+    }
+    searchRoots(&workers[0]);
+    nodes = workers[0].nodes;
+    for (int i = 1; i < nThreads; i++) {
+      pthread_join(threads[i], NULL);
+      nodes += workers[i].nodes;
+    }
+  }
+  gettimeofday(&t1, NULL);
+  double ms = (t1.tv_sec - t0.tv_sec) * 1000.0 + (t1.tv_usec - t0.tv_usec) / 1000.0;
+  preparePruning(NULL, NULL, 0);
+  cout << (solved ? "Solution found" : gaveUp ? "Gave up, time budget exhausted," : "No solution") << " in " << ms
+      << " ms, " << nodes << " positions searched by " << nThreads << " threads" << endl;
+  if (solved && show) {
+    for (int i = 0; i < solutionLength; i++)
+      showPosition(solution[i], solutionFull[i]);
+  }
+  arenaRelease(mark);
+  deadTable = NULL;
+  roots = NULL;
+  return solved != 0;
+}
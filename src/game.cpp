@@ -10,6 +10,12 @@
 #include <time.h>
 #include <string.h>
 #include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <algorithm>
+#include "codedMove.h"
 using namespace std;
 
 static const int NO_OF_HOLES = 33;
@@ -17,11 +23,41 @@ static const int FINAL_LEVEL = 32;
 static const int MID_LEVEL = 16;
 
 void trimMidHalfLevel(bool centreHoleIsFull);
+extern uint32_t fileIntersection(const char * aName, const char * bName, bool complementB, const char * outName,
+    uint32_t * topBits);
+extern const uint32_t setOpFailed;
+extern uint32_t exportLevelFile(const char * fileName, bool full, char format, FILE * out);
+extern bool expandLevelNuma(int level, bool show);
+extern void * arenaAlloc(size_t bytes);
+extern size_t arenaMark();
+extern void arenaRelease(size_t mark);
+extern void arenaReport();
+extern void arenaUseNode(int node);
+extern int arenaNode();
+extern bool checkLevelFile(int level, bool full, bool verifySums);
+extern bool checkLevel(int level);
+struct levelSums;
+extern levelSums * startLevelSums();
+extern void addLevelSums(levelSums * s, const uint32_t * values, uint32_t n);
+extern void finishLevelSums(levelSums * s, const char * fileName);
+extern void renameLevelFile(const char * from, const char * to);
+extern bool rankedValueFound(int level, bool full, uint32_t value, bool * found);
 
-const uint32_t bufSize = 10000;
-uint32_t sbuf[bufSize];
-uint32_t lobuf[bufSize];
-uint32_t hibuf[bufSize];
+/*
+ * Expand, sort and uniq each level in partitions placed on the NUMA nodes of the machine.
+ */
+bool numaMode = false;
+
+/*
+ * Elements held in memory by each thread of the external sort and by longUniq,
+ * unless planLevel chooses another size for a level.
+ */
+extern const uint32_t bufSize = 10000;
+
+/*
+ * Memory the sort of a level may use, 0 for no limit other than the external sort.
+ */
+uint64_t memoryBudget = (uint64_t)256 << 20;
 
 const char * myFileName = "testFile.out";
 const char * modeCreateWriteBinary = "wb";
@@ -42,25 +78,6 @@ struct move {
   int to;
 };
 
-/*
- * In a coded move each peg position is represented by a bit in a 32-bit word.
- * The bit position is the given by the peg number in the 'positions' array
- * The mask has a 1 in the 'from', 'middle' and 'to' positions of the move.
- * The match has a 1 in the 'from' and 'middle' position of the move.
- * The move is possible if of masking the board status with the mask the
- * result is the match.
- * Executing the move is equivalent to XOR-in the coded board status with the
- * mask.
- * The word that represents the board status has 32 bits, hence it can represent
- * only holes 0-31. Hole 32 is represented separately to avoid having to use
- * 64 bits to represent the board status.
- * TODO: would a 64-bit representation be faster?
- */
-struct coded_move {
-  uint32_t mask;
-  uint32_t match;
-};
-
 /*
  * The array positions[][] represent the playing board,
  * where the holes that initially contain a peg are numbered as follows.
@@ -194,6 +211,117 @@ void prepareAllMoves ()
   }
 }
 
+/*
+ * A pagoda function gives each hole a weight such that for every move
+ * weight(to) <= weight(from) + weight(middle), so the total weight of the pegs
+ * never increases. A position weighing less than the lightest target cannot
+ * reach any target and can be dropped as soon as it is generated.
+ * Weights from 0 to 3 are held as two masks over holes 0-31, plus the weight
+ * of the centre hole, so weighing a position takes two popcounts.
+ */
+struct pagoda {
+  uint32_t ones;
+  uint32_t twos;
+  int centre;
+  int threshold;
+};
+
+const int maxPagodas = 16;
+pagoda pagodas[maxPagodas];
+int nPagodas = 0;
+
+/*
+ * Weights by row or column of the board. A weight that depends only on the row
+ * is a pagoda function if every three consecutive rows a, b, c have
+ * a <= b + c and c <= a + b; the same holds for columns.
+ */
+static const int pagodaPatterns[][7] = {
+  {1, 1, 0, 1, 1, 0, 1},
+  {0, 1, 1, 0, 1, 1, 0},
+  {1, 0, 1, 1, 0, 1, 1},
+  {2, 1, 1, 0, 1, 1, 2},
+  {3, 2, 1, 1, 0, 1, 1},
+  {1, 1, 0, 1, 1, 2, 3}
+};
+static const int nPagodaPatterns = sizeof(pagodaPatterns) / sizeof(pagodaPatterns[0]);
+
+int pagodaWeight(const pagoda * pg, uint32_t pos, bool full) {
+  return __builtin_popcount(pos & pg->ones) + 2 * __builtin_popcount(pos & pg->twos) + (full ? pg->centre : 0);
+}
+
+static bool isPagoda(const int * w, const move * m, int n) {
+  for (int i = 0; i < n; i++) {
+    if (w[m[i].to] > w[m[i].from] + w[m[i].middle])
+      return false;
+  }
+  return true;
+}
+
+/*
+ * Choose the pagoda functions that separate some positions from the targets,
+ * and set their thresholds to the weight of the lightest target.
+ * With no targets pruning is switched off.
+ */
+void preparePruning(const uint32_t * targets, const bool * targetsFull, int nTargets) {
+  nPagodas = 0;
+  for (int k = 0; k < 2 * nPagodaPatterns && nTargets > 0 && nPagodas < maxPagodas; k++) {
+    const int * pattern = pagodaPatterns[k / 2];
+    bool byColumn = (k % 2) == 1;
+    int w[NO_OF_HOLES];
+    pagoda pg = {0, 0, pattern[3], 0};
+    w[32] = pattern[3];
+    for (int i = 0; i < 7; i++) {
+      for (int j = 0; j < 7; j++) {
+        int h = positions[i][j];
+        if (h < 0)
+          continue;
+        w[h] = pattern[byColumn ? j : i];
+        if (w[h] & 1)
+          pg.ones |= 1 << h;
+        if (w[h] & 2)
+          pg.twos |= 1 << h;
+      }
+    }
+    if (!isPagoda(w, normal_moves, nNormal) || !isPagoda(w, e2f_moves, ne2f) || !isPagoda(w, f2e_moves, nf2e))
+      continue;
+    pg.threshold = pagodaWeight(&pg, targets[0], targetsFull[0]);
+    for (int t = 1; t < nTargets; t++) {
+      int tw = pagodaWeight(&pg, targets[t], targetsFull[t]);
+      if (tw < pg.threshold)
+        pg.threshold = tw;
+    }
+    if (pg.threshold > 0)
+      pagodas[nPagodas++] = pg;
+  }
+}
+
+/*
+ * Check that no pagoda function rules out reaching the targets from a position.
+ */
+bool canReachTargets(uint32_t pos, bool full) {
+  for (int k = 0; k < nPagodas; k++) {
+    if (pagodaWeight(&pagodas[k], pos, full) < pagodas[k].threshold)
+      return false;
+  }
+  return true;
+}
+
+/*
+ * Copy into cm the moves that can be played on a position with the centre hole
+ * full or empty: first the normal moves, then the *nCentre moves that change the
+ * centre hole. Return the total number of moves.
+ */
+int getCodedMoves(bool full, coded_move * cm, int * nCentre) {
+  int n = 0;
+  for (int i = 0; i < nNormal; i++)
+    cm[n++] = moves_normal[i];
+  const coded_move * centre = full ? moves_f2e : moves_e2f;
+  *nCentre = full ? nf2e : ne2f;
+  for (int i = 0; i < *nCentre; i++)
+    cm[n++] = centre[i];
+  return n;
+}
+
 /*
  * Compare uint32_ts pointed to by void pointers
  */
@@ -205,73 +333,266 @@ int unsignedLongCompare (const void * elem1, const void * elem2 )
 }
 
 /*
- * Removed duplicates from an ordered file of uint32_ts.
+ * Returned by longUniq when its input is not sorted.
+ */
+extern const uint32_t uniqFailed = (uint32_t)-1;
+
+/*
+ * Removed duplicates from an ordered file of uint32_ts, reading bufferSize elements at a time.
+ * The buffer is local, so files can be uniq-ed by several threads at once.
+ * If topBits is not NULL the unique values are counted by their top 8 bits.
+ * The checksums of the blocks written are recorded with the file.
+ * If the file turns out not to be sorted it is left as it was and uniqFailed is returned.
  */
-uint32_t longUniq(const char * fileName)
+uint32_t longUniq(const char * fileName, uint32_t * topBits, uint32_t bufferSize)
 {
   char tempName[L_tmpnam];
   FILE * fr = fopen(fileName, modeOpenReadBinary);
   tmpnam(tempName);
   FILE * fw = fopen(tempName, modeCreateWriteBinary);
+  size_t mark = arenaMark();
+  uint32_t * ubuf = (uint32_t *)arenaAlloc(bufferSize * sizeof(uint32_t));
+  levelSums * sums = startLevelSums();
   // read and write the first unsigned
   uint32_t lv;
   uint32_t ucount = 0;
   if (fread (&lv, sizeof(uint32_t), 1, fr) == 1) {
       fwrite(&lv, sizeof(uint32_t), 1, fw);
+      addLevelSums(sums, &lv, 1);
       ucount++;
+      if (topBits != NULL)
+        topBits[lv >> 24]++;
   }
   while (1) {
     // read a buffer worth
-    int sbufc = fread (sbuf, sizeof(uint32_t), bufSize, fr);
-    if (sbufc <= 0)
+    int ubufc = fread (ubuf, sizeof(uint32_t), bufferSize, fr);
+    if (ubufc <= 0)
       break;
     // scan the buffer for unique values in the buffer
-    int sbufr = 0;
-    int sbufw = 0;
-    while (sbufr < sbufc) {
-      uint32_t v = sbuf[sbufr++];
+    int ubufr = 0;
+    int ubufw = 0;
+    while (ubufr < ubufc) {
+      uint32_t v = ubuf[ubufr++];
       if (v < lv) {
-        cout << "error: v=" << v << "; lv=" << lv << endl;  // out of sequence
-        return ucount;
+        cout << "error: v=" << v << "; lv=" << lv << " in " << fileName << endl;  // out of sequence
+        fclose(fr);
+        fclose(fw);
+        remove(tempName);
+        finishLevelSums(sums, NULL);
+        arenaRelease(mark);
+        return uniqFailed;
       }
       if (v > lv)
-        lv = sbuf[sbufw++] = v;
+        lv = ubuf[ubufw++] = v;
     }
     // write out the unique values left in the buffer
-    if (sbufw > 0) {
-      fwrite(sbuf, sizeof(uint32_t), sbufw, fw);
-      ucount += sbufw;
+    if (ubufw > 0) {
+      fwrite(ubuf, sizeof(uint32_t), ubufw, fw);
+      addLevelSums(sums, ubuf, ubufw);
+      ucount += ubufw;
+      if (topBits != NULL) {
+        for (int i = 0; i < ubufw; i++)
+          topBits[ubuf[i] >> 24]++;
+      }
     }
   }
   fclose(fr);
   fclose(fw);
   remove (fileName);
   rename (tempName, fileName);
+  finishLevelSums(sums, fileName);
+  arenaRelease(mark);
   return ucount;
 }
 
 /*
- * Quick sort an area of a file of uint32_t integers, starting at the element of index 'lo'
- * and ending at the element of index 'hi'
- */
-void quickFileSort(FILE * f, uint32_t lo, uint32_t hi) {
-  if (lo>=hi) return; /* nothing left to sort */
-  uint32_t n = hi - lo + 1; /* size of area to sort */
-  if (n <= bufSize) {
-	 /* the area is small enough to be sorted in memory */
-     fseek ( f, lo * sizeof(uint32_t), SEEK_SET );
-     fread (sbuf, sizeof(uint32_t), n, f);
-     qsort (sbuf, n, sizeof(uint32_t), unsignedLongCompare );
-     fseek ( f, lo * sizeof(uint32_t), SEEK_SET );
-     fwrite(sbuf, sizeof(uint32_t), n, f);
-     return;
-  }
-  int sbufc, lobufc, hibufc;
+ * Read or write 'n' elements of a file starting at the element of index 'at'.
+ * Positioned reads and writes do not share a seek pointer, so several threads
+ * can work on disjoint areas of the same file.
+ * Short transfers and interrupted calls are retried; return false on an error
+ * or, when reading, on the end of the file.
+ */
+bool readElements(int fd, uint32_t * buf, uint32_t at, uint32_t n) {
+  char * p = (char *)buf;
+  size_t left = n * sizeof(uint32_t);
+  off_t offset = (off_t)at * sizeof(uint32_t);
+  while (left > 0) {
+    ssize_t c = pread(fd, p, left, offset);
+    if (c < 0 && (errno == EINTR || errno == EAGAIN))
+      continue;
+    if (c <= 0) {
+      cout << "error reading file at " << offset << endl;
+      return false;
+    }
+    p += c;
+    offset += c;
+    left -= c;
+  }
+  return true;
+}
+
+static bool writeElements(int fd, const uint32_t * buf, uint32_t at, uint32_t n) {
+  const char * p = (const char *)buf;
+  size_t left = n * sizeof(uint32_t);
+  off_t offset = (off_t)at * sizeof(uint32_t);
+  while (left > 0) {
+    ssize_t c = pwrite(fd, p, left, offset);
+    if (c < 0 && (errno == EINTR || errno == EAGAIN))
+      continue;
+    if (c <= 0) {
+      cout << "error writing sort file at " << offset << endl;
+      return false;
+    }
+    p += c;
+    offset += c;
+    left -= c;
+  }
+  return true;
+}
+
+/*
+ * Number of threads used by the parallel phases, 0 means one per online processor.
+ */
+int threadCount = 0;
+const int maxThreads = 64;
+
+int getThreadCount() {
+  int n = threadCount;
+  if (n <= 0)
+    n = sysconf(_SC_NPROCESSORS_ONLN);
+  if (n < 1)
+    n = 1;
+  if (n > maxThreads)
+    n = maxThreads;
+  return n;
+}
+
+/*
+ * An area of the file still to be sorted, from element 'lo' to element 'hi'.
+ */
+struct sortTask {
+  uint32_t lo;
+  uint32_t hi;
+};
+
+/*
+ * Each worker owns a deque of tasks and its own buffers.
+ * The owner pushes and pops at the tail, idle workers steal from the head,
+ * where the oldest and therefore largest areas are.
+ */
+const int sortQueueSize = 256;
+
+struct sortWorker {
+  pthread_mutex_t lock;
+  sortTask tasks[sortQueueSize];
+  int head;
+  int tail;
+  uint32_t * sbuf;
+  uint32_t * lobuf;
+  uint32_t * hibuf;
+  struct sortPool * pool;
+};
+
+struct sortPool {
+  int fd;
+  int nWorkers;
+  volatile int pending; // tasks queued or being sorted
+  volatile int failed; // set by the first read or write error, the remaining tasks are dropped
+  int arenaNode; // the workers allocate from the arena of the caller
+  uint32_t bufSize; // elements of each of the three buffers of a worker
+  sortWorker workers[maxThreads];
+};
+
+/*
+ * Read or write an area of the file being sorted, noting any error in the pool.
+ */
+static bool readArea(sortPool * pool, uint32_t * buf, uint32_t at, uint32_t n) {
+  if (pool->failed || !readElements(pool->fd, buf, at, n)) {
+    pool->failed = 1;
+    return false;
+  }
+  return true;
+}
+
+static bool writeArea(sortPool * pool, const uint32_t * buf, uint32_t at, uint32_t n) {
+  if (pool->failed || !writeElements(pool->fd, buf, at, n)) {
+    pool->failed = 1;
+    return false;
+  }
+  return true;
+}
+
+static bool pushTask(sortWorker * w, uint32_t lo, uint32_t hi) {
+  bool pushed = false;
+  pthread_mutex_lock(&w->lock);
+  if (w->tail - w->head < sortQueueSize) {
+    if (w->tail == sortQueueSize) {
+      memmove(w->tasks, w->tasks + w->head, (w->tail - w->head) * sizeof(sortTask));
+      w->tail -= w->head;
+      w->head = 0;
+    }
+    w->tasks[w->tail].lo = lo;
+    w->tasks[w->tail].hi = hi;
+    w->tail++;
+    pushed = true;
+  }
+  pthread_mutex_unlock(&w->lock);
+  return pushed;
+}
+
+static bool takeTask(sortWorker * w, bool steal, sortTask * t) {
+  bool taken = false;
+  pthread_mutex_lock(&w->lock);
+  if (w->tail > w->head) {
+    *t = steal ? w->tasks[w->head++] : w->tasks[--w->tail];
+    taken = true;
+  }
+  pthread_mutex_unlock(&w->lock);
+  return taken;
+}
+
+/*
+ * Choose the median of the first, middle and last element as pivot,
+ * and move it to the first position.
+ * The output of the expansion is often nearly sorted, so the first element alone
+ * would make the partitions very uneven.
+ */
+static uint32_t choosePivot(sortPool * pool, uint32_t lo, uint32_t hi) {
+  uint32_t mid = lo + (hi - lo) / 2;
+  uint32_t a = 0, b = 0, c = 0;
+  if (!readArea(pool, &a, lo, 1) || !readArea(pool, &b, mid, 1) || !readArea(pool, &c, hi, 1))
+    return a;
+  uint32_t at = lo;
+  uint32_t pv = a;
+  if ((a <= b && b <= c) || (c <= b && b <= a)) {
+    at = mid;
+    pv = b;
+  } else if ((a <= c && c <= b) || (b <= c && c <= a)) {
+    at = hi;
+    pv = c;
+  }
+  if (at != lo) {
+    writeArea(pool, &pv, lo, 1);
+    writeArea(pool, &a, at, 1);
+  }
+  return pv;
+}
+
+/*
+ * Partition the area from lo to hi around a pivot and return the final index of the pivot.
+ * Elements equal to the pivot go alternately to the low and the high side, so that
+ * an area with many duplicates is still split in two halves.
+ * On a read or write error the pool is marked as failed and the result is meaningless.
+ */
+static uint32_t partitionFileArea(sortWorker * w, uint32_t lo, uint32_t hi) {
+  sortPool * pool = w->pool;
+  uint32_t * sbuf = w->sbuf;
+  uint32_t * lobuf = w->lobuf;
+  uint32_t * hibuf = w->hibuf;
+  uint32_t sbufc, lobufc, hibufc;
   uint32_t c, lofr, lofw, hifr, hifw;
-  uint32_t pv;
-  // read the first element as pivot value
-  fseek( f, lo * sizeof(uint32_t), SEEK_SET);
-  fread(&pv, sizeof(uint32_t), 1, f);
+  uint32_t pv = choosePivot(pool, lo, hi);
+  bool equalToHigh = false;
   lofw = lo;
   lofr = lo + 1;  // skip after pivot, which has already been read
   hifr = hifw = hi + 1;  // point after last unprocessed in file
@@ -286,35 +607,35 @@ void quickFileSort(FILE * f, uint32_t lo, uint32_t hi) {
       if (c > hifr - lofr)
          c = hifr - lofr;
       if (c > 0) {
-        fseek(f, (hifr-c) * sizeof(uint32_t), SEEK_SET);
-        fread(sbuf, sizeof(uint32_t), c, f);
+        if (!readArea(pool, sbuf, hifr - c, c))
+          return lo;
         sbufc = c;
         hifr -= c;
       }
     }
     // copy the high buffer to the high end
     if (hibufc > 0) {
-      fseek( f, (hifw - hibufc) * sizeof(uint32_t), SEEK_SET);
-      fwrite(hibuf, sizeof(uint32_t), hibufc, f);
+      if (!writeArea(pool, hibuf, hifw - hibufc, hibufc))
+        return lo;
       hifw -= hibufc;
       hibufc = 0;
     }
     // free the low end by filling in the rest of the source buffer
-    if (sbufc < bufSize) {
-      c = bufSize - sbufc;
+    if (sbufc < pool->bufSize) {
+      c = pool->bufSize - sbufc;
       if (c > hifr - lofr)
         c = hifr - lofr;
       if (c > 0) {
-        fseek( f, lofr * sizeof(uint32_t), SEEK_SET);
-        fread(sbuf + sbufc, sizeof(uint32_t), c, f);
+        if (!readArea(pool, sbuf + sbufc, lofr, c))
+          return lo;
         sbufc += c;
         lofr += c;
       }
     }
     // copy the low buffer to the low end
     if (lobufc > 0) {
-      fseek( f, lofw * sizeof(uint32_t), SEEK_SET);
-      fwrite(lobuf, sizeof(uint32_t), lobufc, f);
+      if (!writeArea(pool, lobuf, lofw, lobufc))
+        return lo;
       lofw += lobufc;
       lobufc = 0;
     }
@@ -324,28 +645,287 @@ void quickFileSort(FILE * f, uint32_t lo, uint32_t hi) {
     // sort the content of the source buffer into the low or high buffers
     while (sbufc) {
       uint32_t v = sbuf[--sbufc];
-      if (v > pv)
+      if (v == pv) {
+        equalToHigh = !equalToHigh;
+        if (equalToHigh)
+          hibuf[hibufc++] = v;
+        else
+          lobuf[lobufc++] = v;
+      } else if (v > pv)
         hibuf[hibufc++] = v;
       else
         lobuf[lobufc++] = v;
     }
   }
   // put the pivot back where it belongs
-  fseek( f, lofw * sizeof(uint32_t), SEEK_SET);
-  fwrite(&pv, sizeof(uint32_t), 1, f);
-  quickFileSort(f, lo, lofw-1);
-  quickFileSort(f, lofw+1, hi);
+  writeArea(pool, &pv, lofw, 1);
+  return lofw;
 }
 
-char * getName(int level, bool centreHoleFull, bool isTrimmed) {
-  static char buf[20];
-  buf[0] = centreHoleFull ? 'F' : 'E';
-  buf[1] = '0' + (char)(level /10);
-  buf[2] = '0' + (char)(level %10);
-  strcpy(buf+3, isTrimmed ? "T.gam" : ".gam");
+/*
+ * Sort an area of the file. The smaller side of each partition is left in the
+ * worker's deque for itself or other workers, the larger side is partitioned again at once.
+ * When the deque is full the smaller side is sorted by a recursive call, which therefore
+ * nests at most log2(n / bufSize) deep.
+ */
+static void sortFileArea(sortWorker * w, uint32_t lo, uint32_t hi) {
+  while (lo < hi && hi - lo + 1 > w->pool->bufSize && !w->pool->failed) {
+    uint32_t p = partitionFileArea(w, lo, hi);
+    if (w->pool->failed)
+      return;
+    uint32_t slo = lo, shi = p - 1; // smaller side
+    uint32_t llo = p + 1, lhi = hi; // larger side
+    if (p - lo > hi - p) {
+      slo = p + 1; shi = hi;
+      llo = lo; lhi = p - 1;
+    }
+    if (p == lo) {
+      lo = llo; hi = lhi;
+      continue;
+    }
+    if (slo < shi) {
+      __sync_fetch_and_add(&w->pool->pending, 1);
+      if (!pushTask(w, slo, shi)) {
+        __sync_fetch_and_sub(&w->pool->pending, 1);
+        sortFileArea(w, slo, shi);
+      }
+    }
+    lo = llo; hi = lhi;
+  }
+  if (lo >= hi || hi == (uint32_t)-1) return; /* nothing left to sort */
+  uint32_t n = hi - lo + 1;
+  /* the area is small enough to be sorted in memory */
+  if (!readArea(w->pool, w->sbuf, lo, n))
+    return;
+  qsort (w->sbuf, n, sizeof(uint32_t), unsignedLongCompare );
+  writeArea(w->pool, w->sbuf, lo, n);
+}
+
+static void * sortWorkerRun(void * arg) {
+  sortWorker * w = (sortWorker *)arg;
+  sortPool * pool = w->pool;
+  int self = w - pool->workers;
+  arenaUseNode(pool->arenaNode);
+  w->sbuf = (uint32_t *)arenaAlloc(3 * pool->bufSize * sizeof(uint32_t));
+  w->lobuf = w->sbuf + pool->bufSize;
+  w->hibuf = w->lobuf + pool->bufSize;
+  sortTask t;
+  while (pool->pending > 0) {
+    bool found = takeTask(w, false, &t);
+    for (int i = 1; !found && i < pool->nWorkers; i++)
+      found = takeTask(&pool->workers[(self + i) % pool->nWorkers], true, &t);
+    if (found) {
+      if (!pool->failed)
+        sortFileArea(w, t.lo, t.hi);
+      __sync_fetch_and_sub(&pool->pending, 1);
+    } else {
+      sched_yield();
+    }
+  }
+  return NULL;
+}
+
+/*
+ * Quick sort an area of a file of uint32_t integers, starting at the element of index 'lo'
+ * and ending at the element of index 'hi'.
+ * Disjoint partitions are sorted concurrently by a pool of nThreads work-stealing threads,
+ * each holding three buffers of bufferSize elements.
+ * The threads inherit the processor affinity of the caller.
+ * Return false if the file could not be read or written, leaving it partly sorted.
+ */
+bool quickFileSort(FILE * f, uint32_t lo, uint32_t hi, int nThreads, uint32_t bufferSize) {
+  if (lo>=hi || hi == (uint32_t)-1) return true; /* nothing left to sort */
+  fflush(f);
+  sortPool * pool = new sortPool;
+  pool->fd = fileno(f);
+  pool->nWorkers = (nThreads < 1) ? 1 : (nThreads > maxThreads) ? maxThreads : nThreads;
+  pool->pending = 1;
+  pool->failed = 0;
+  pool->arenaNode = arenaNode();
+  pool->bufSize = bufferSize;
+  size_t mark = arenaMark();
+  for (int i = 0; i < pool->nWorkers; i++) {
+    pthread_mutex_init(&pool->workers[i].lock, NULL);
+    pool->workers[i].head = pool->workers[i].tail = 0;
+    pool->workers[i].pool = pool;
+  }
+  pushTask(&pool->workers[0], lo, hi);
+  pthread_t threads[maxThreads];
+  for (int i = 1; i < pool->nWorkers; i++)
+    pthread_create(&threads[i], NULL, sortWorkerRun, &pool->workers[i]);
+  sortWorkerRun(&pool->workers[0]);
+  for (int i = 1; i < pool->nWorkers; i++)
+    pthread_join(threads[i], NULL);
+  for (int i = 0; i < pool->nWorkers; i++)
+    pthread_mutex_destroy(&pool->workers[i].lock);
+  arenaRelease(mark);
+  bool sorted = !pool->failed;
+  delete pool;
+  return sorted;
+}
+
+bool quickFileSort(FILE * f, uint32_t lo, uint32_t hi) {
+  return quickFileSort(f, lo, hi, getThreadCount(), bufSize);
+}
+
+/*
+ * Prefix of the level file names, so that the levels of different searches
+ * can share a directory.
+ */
+static const int nameSize = 64;
+static char levelNamePrefix[nameSize - 8] = "";
+
+/*
+ * Name of a level file of the search with the given prefix, without switching to it.
+ */
+char * getPrefixedName(const char * prefix, int level, bool centreHoleFull, bool isTrimmed) {
+  static char buf[nameSize];
+  int p = strlen(prefix);
+  if (p > nameSize - 9)
+    p = nameSize - 9;
+  memcpy(buf, prefix, p);
+  buf[p] = centreHoleFull ? 'F' : 'E';
+  buf[p+1] = '0' + (char)(level /10);
+  buf[p+2] = '0' + (char)(level %10);
+  strcpy(buf+p+3, isTrimmed ? "T.gam" : ".gam");
   return buf;
 }
 
+char * getName(int level, bool centreHoleFull, bool isTrimmed) {
+  return getPrefixedName(levelNamePrefix, level, centreHoleFull, isTrimmed);
+}
+
+/*
+ * Statistics of each half level, collected by the kernels that produce and read it,
+ * so that no extra pass over the level files is needed:
+ * - generated: positions written by the expansion of the previous level, known to the sort
+ * - unique: positions left by longUniq
+ * - successors: number of positions of this half level by number of successors, counted
+ *   by expandBuffer when this level is expanded
+ * - topBits: unique positions by their top 8 bits, counted by longUniq
+ * They are kept in memory and saved next to the level file, see getStatsName.
+ */
+extern const int topBitsBuckets = 256;
+extern const int successorBuckets = nNormal + nf2e + 1;
+
+struct levelStats {
+  bool loaded; // the statistics of the current level file are in memory, produced or read in this run
+  uint32_t generated;
+  uint32_t unique;
+  uint32_t successors[successorBuckets];
+  uint32_t topBits[topBitsBuckets];
+};
+
+levelStats stats[NO_OF_HOLES + 1][2];
+
+char * getStatsName(int level, bool centreHoleFull) {
+  char * name = getName(level, centreHoleFull, false);
+  strcpy(strchr(name, '.'), ".sta");
+  return name;
+}
+
+uint32_t * levelSuccessors(int level, bool full) {
+  return stats[level][full].successors;
+}
+
+uint32_t * levelTopBits(int level, bool full) {
+  return stats[level][full].topBits;
+}
+
+/*
+ * Forget the statistics of a half level that is about to be produced again.
+ */
+void clearLevelStats(int level, bool full) {
+  memset(&stats[level][full], 0, sizeof(levelStats));
+}
+
+/*
+ * Switch to the levels of another search. The statistics in memory belong to
+ * the previous prefix, so they are dropped.
+ */
+void setLevelNamePrefix(const char * prefix) {
+  strncpy(levelNamePrefix, prefix, sizeof(levelNamePrefix) - 1);
+  memset(stats, 0, sizeof(stats));
+}
+
+void noteLevelCounts(int level, bool full, uint32_t generated, uint32_t unique) {
+  stats[level][full].loaded = true;
+  stats[level][full].generated = generated;
+  stats[level][full].unique = unique;
+}
+
+/*
+ * Save the statistics of a half level as text, one item per line.
+ */
+void writeLevelStats(int level, bool full) {
+  levelStats * ls = &stats[level][full];
+  FILE * f = fopen(getStatsName(level, full), "w");
+  if (f == NULL) {
+    cout << "cannot write statistics of level " << level << endl;
+    return;
+  }
+  fprintf(f, "level %d\n", level);
+  fprintf(f, "full %d\n", full ? 1 : 0);
+  fprintf(f, "generated %u\n", ls->generated);
+  fprintf(f, "unique %u\n", ls->unique);
+  fprintf(f, "duplicateFactor %.3f\n", ls->unique > 0 ? (double)ls->generated / ls->unique : 0.0);
+  uint64_t expanded = 0;
+  uint64_t successors = 0;
+  for (int i = 0; i < successorBuckets; i++) {
+    expanded += ls->successors[i];
+    successors += (uint64_t)i * ls->successors[i];
+  }
+  fprintf(f, "meanSuccessors %.3f\n", expanded > 0 ? (double)successors / expanded : 0.0);
+  fprintf(f, "successors");
+  for (int i = 0; i < successorBuckets; i++)
+    fprintf(f, " %u", ls->successors[i]);
+  fprintf(f, "\ntopBits");
+  for (int i = 0; i < topBitsBuckets; i++)
+    fprintf(f, " %u", ls->topBits[i]);
+  fprintf(f, "\n");
+  fclose(f);
+}
+
+/*
+ * Load the saved statistics of a half level, return false if there are none.
+ */
+bool readLevelStats(int level, bool full) {
+  levelStats * ls = &stats[level][full];
+  FILE * f = fopen(getStatsName(level, full), "r");
+  if (f == NULL)
+    return false;
+  clearLevelStats(level, full);
+  char key[32];
+  while (fscanf(f, "%31s", key) == 1) {
+    if (strcmp(key, "generated") == 0) {
+      fscanf(f, "%u", &ls->generated);
+    } else if (strcmp(key, "unique") == 0) {
+      fscanf(f, "%u", &ls->unique);
+    } else if (strcmp(key, "successors") == 0) {
+      for (int i = 0; i < successorBuckets; i++)
+        fscanf(f, "%u", &ls->successors[i]);
+    } else if (strcmp(key, "topBits") == 0) {
+      for (int i = 0; i < topBitsBuckets; i++)
+        fscanf(f, "%u", &ls->topBits[i]);
+    } else {
+      fscanf(f, "%*s");
+    }
+  }
+  fclose(f);
+  ls->loaded = true;
+  return true;
+}
+
+/*
+ * Make sure the statistics of a half level are in memory, reading them if the level
+ * was produced by an earlier run. An empty half level has statistics too, so the
+ * counts cannot tell whether they are there.
+ */
+static void loadLevelStats(int level, bool full) {
+  if (!stats[level][full].loaded)
+    readLevelStats(level, full);
+}
+
 #if 0
 void debugMove(uint32_t source, uint32_t mask, uint32_t match, uint32_t dest, bool matched, char type) {
   cout.setf(ios::hex, ios::basefield);
@@ -367,22 +947,25 @@ void debugNewMove (uint32_t m1, uint32_t m2, uint32_t m3, uint32_t m4) {
  * at the next level and store them in the destination file (if the centre hole remains the same)
  * or in the complement destination file (if the centre hole has changed from full to empty or
  * empty to full.
+ * dbuf and dcbuf are working buffers of dl and dcl elements.
+ * successors[n] is incremented for each source position with n successors.
  */
-void expandBuffer(bool full, uint32_t * sbuf, int sc, FILE* fdest, FILE* fdestComplement) {
-  const int dl = 10000;
-  const int dcl = 1000;
-  uint32_t dbuf[dl], dcbuf[dcl];
+void expandBuffer(bool full, uint32_t * sbuf, int sc, uint32_t * dbuf, int dl, uint32_t * dcbuf, int dcl,
+    FILE* fdest, FILE* fdestComplement, uint32_t * successors) {
   int dc = 0;
   int dcc = 0;
   while (sc > 0) {
     uint32_t s = sbuf[--sc];
+    int before = dc + dcc;
     // make all the moves that leave the centre hole unchanged
     for (int i = 0; i < nNormal; i++) {
       uint32_t d = moves_normal[i].mask;
 //      debugMove(s, moves_normal[i].mask, moves_normal[i].match, d, false, 'n');
       if ((s & d) == moves_normal[i].match) {
         d = s ^ d;
-        if ( dc < dl - 4) {
+        if (nPagodas > 0 && !canReachTargets(d, full)) {
+          // pruned
+        } else if ( dc < dl - 4) {
 //          cout << "New move found - normal = " << d << endl;
           dbuf[dc++] = d;
 #if 0
@@ -405,7 +988,9 @@ void expandBuffer(bool full, uint32_t * sbuf, int sc, FILE* fdest, FILE* fdestCo
         uint32_t d = moves_f2e[i].mask;
         if ((s & d) == moves_f2e[i].match) {
           d = s ^ d;
-          if ( dcc < dcl - 4) {
+          if (nPagodas > 0 && !canReachTargets(d, false)) {
+            // pruned
+          } else if ( dcc < dcl - 4) {
 //            cout << "New move found - f2e = " << d << endl;
             dcbuf[dcc++] = d;
 #if 0
@@ -428,7 +1013,9 @@ void expandBuffer(bool full, uint32_t * sbuf, int sc, FILE* fdest, FILE* fdestCo
         uint32_t d = moves_e2f[i].mask;
         if ((s & d) == moves_e2f[i].match) {
           d = s ^ d;
-          if ( dcc < dcl - 4) {
+          if (nPagodas > 0 && !canReachTargets(d, true)) {
+            // pruned
+          } else if ( dcc < dcl - 4) {
 //            cout << "New move found - e2f = " << d << endl;
             dcbuf[dcc++] = d;
 #if 0
@@ -445,6 +1032,7 @@ void expandBuffer(bool full, uint32_t * sbuf, int sc, FILE* fdest, FILE* fdestCo
         }
       }
     }
+    successors[dc + dcc - before]++;
   }
   if (dc > 0) {
     fwrite(dbuf, sizeof(uint32_t), dc, fdest);
@@ -455,17 +1043,164 @@ void expandBuffer(bool full, uint32_t * sbuf, int sc, FILE* fdest, FILE* fdestCo
 }
 
 /*
- *
+ * Number of positions expanded together by expandTile, small enough for the tile
+ * and its successors to stay in the L2 cache.
  */
-void expandHalfLevel(bool full, FILE* fsource, FILE* fdest, FILE* fdestComplement) {
-  const int sl = 20;
-  uint32_t sbuf[sl];
-  while (1) {
-    int sc = fread(sbuf, sizeof(uint32_t), sl, fsource);
+const int tileSize = 2048;
+
+/*
+ * The normal moves are listed in four groups of 16, each group all the jumps in one
+ * direction and the rotation by 90 degrees of the previous one: group 0 holds every
+ * downward jump.
+ */
+const int moveGroupSize = 16;
+const int nMoveGroups = nNormal / moveGroupSize;
+
+/*
+ * Apply one group of moves to all the positions of a tile.
+ * Each successor is stored at the end of dbuf, which only advances when the move
+ * is possible, so the loop has no branch on the move.
+ * count[k] is incremented for each successor of position k.
+ * Return the number of successors stored.
+ */
+static inline int expandTileGroup(bool full, const uint32_t * sbuf, int sc, const coded_move * group, int n,
+    uint32_t * dbuf, unsigned char * count) {
+  uint32_t mask[moveGroupSize];
+  uint32_t match[moveGroupSize];
+  for (int i = 0; i < n; i++) {
+    mask[i] = group[i].mask;
+    match[i] = group[i].match;
+  }
+  int dc = 0;
+  for (int k = 0; k < sc; k++) {
+    uint32_t s = sbuf[k];
+    int before = dc;
+    for (int i = 0; i < n; i++) {
+      uint32_t d = s ^ mask[i];
+      int ok = ((s & mask[i]) == match[i]);
+      if (ok && nPagodas > 0)
+        ok = canReachTargets(d, full);
+      dbuf[dc] = d;
+      dc += ok;
+    }
+    count[k] += dc - before;
+  }
+  return dc;
+}
+
+/*
+ * Blocked version of expandBuffer: rather than all the moves to one position, apply
+ * one group of moves at a time to all the positions of a tile.
+ * The masks of the group are loaded once per tile, and the successors of each group
+ * are appended to the region of dbuf, or of dcbuf for the moves through the centre,
+ * so the writes are sequential.
+ * dbuf must hold sc * nNormal + 1 elements and dcbuf sc * nf2e + 1.
+ */
+void expandTile(bool full, const uint32_t * sbuf, int sc, uint32_t * dbuf, uint32_t * dcbuf,
+    FILE* fdest, FILE* fdestComplement, uint32_t * successors) {
+  unsigned char count[tileSize];
+  memset(count, 0, sc);
+  int dc = 0;
+  for (int g = 0; g < nMoveGroups; g++)
+    dc += expandTileGroup(full, sbuf, sc, moves_normal + g * moveGroupSize, moveGroupSize, dbuf + dc, count);
+  int dcc;
+  if (full)
+    dcc = expandTileGroup(false, sbuf, sc, moves_f2e, nf2e, dcbuf, count);
+  else
+    dcc = expandTileGroup(true, sbuf, sc, moves_e2f, ne2f, dcbuf, count);
+  for (int k = 0; k < sc; k++)
+    successors[count[k]]++;
+  if (dc > 0)
+    fwrite(dbuf, sizeof(uint32_t), dc, fdest);
+  if (dcc > 0)
+    fwrite(dcbuf, sizeof(uint32_t), dcc, fdestComplement);
+}
+
+/*
+ * Expand at most 'count' positions read from fsource, one tile at a time.
+ * The buffers are taken from the arena and are large enough for all the
+ * successors of a tile.
+ * The positions are expanded by expandBuffer: the k benchmark does not show
+ * expandTile faster on both halves of a level.
+ */
+void expandHalfLevelRange(bool full, FILE* fsource, uint32_t count, FILE* fdest, FILE* fdestComplement,
+    uint32_t * successors) {
+  const uint32_t sl = tileSize;
+  const int dl = sl * nNormal + 4;
+  const int dcl = sl * nf2e + 4;
+  size_t mark = arenaMark();
+  uint32_t * sbuf = (uint32_t *)arenaAlloc((sl + dl + dcl) * sizeof(uint32_t));
+  uint32_t * dbuf = sbuf + sl;
+  uint32_t * dcbuf = dbuf + dl;
+  while (count > 0) {
+    int sc = fread(sbuf, sizeof(uint32_t), (count < sl) ? count : sl, fsource);
     if (sc <= 0)
       break;
-    expandBuffer(full,  sbuf, sc , fdest, fdestComplement);
+    count -= sc;
+    expandBuffer(full, sbuf, sc, dbuf, dl, dcbuf, dcl, fdest, fdestComplement, successors);
   }
+  arenaRelease(mark);
+}
+
+/*
+ * Compare the speed of expandBuffer and expandTile on the positions of a level,
+ * and check that both find as many successors for each position.
+ * The successors are written to a scratch file that is removed afterwards.
+ */
+void benchmarkExpansion(int level) {
+  prepareAllMoves();
+  char scratchName[L_tmpnam];
+  tmpnam(scratchName);
+  for (int full = 0; full < 2; full++) {
+    FILE * f = fopen(getName(level, full, false), modeOpenReadBinary);
+    if (f == NULL) {
+      cout << "cannot open file " << getName(level, full, false) << endl;
+      continue;
+    }
+    fseek(f, 0, SEEK_END);
+    uint32_t len = ftell(f) / sizeof(uint32_t);
+    fseek(f, 0, SEEK_SET);
+    size_t mark = arenaMark();
+    uint32_t * levelPositions = (uint32_t *)arenaAlloc((len + 1) * sizeof(uint32_t));
+    len = fread(levelPositions, sizeof(uint32_t), len, f);
+    fclose(f);
+    const int dl = tileSize * nNormal + 4;
+    const int dcl = tileSize * nf2e + 4;
+    uint32_t * sbuf = (uint32_t *)arenaAlloc((tileSize + dl + dcl) * sizeof(uint32_t));
+    uint32_t * dbuf = sbuf + tileSize;
+    uint32_t * dcbuf = dbuf + dl;
+    uint32_t successors[2][successorBuckets];
+    double seconds[2];
+    for (int blocked = 0; blocked < 2; blocked++) {
+      memset(successors[blocked], 0, sizeof(successors[blocked]));
+      FILE * scratch = fopen(scratchName, modeCreateWriteBinary);
+      clock_t t0 = clock();
+      for (uint32_t at = 0; at < len; at += tileSize) {
+        int sc = (len - at < (uint32_t)tileSize) ? len - at : tileSize;
+        memcpy(sbuf, levelPositions + at, sc * sizeof(uint32_t)); // expandBuffer consumes its source
+        if (blocked)
+          expandTile(full, sbuf, sc, dbuf, dcbuf, scratch, scratch, successors[blocked]);
+        else
+          expandBuffer(full, sbuf, sc, dbuf, dl, dcbuf, dcl, scratch, scratch, successors[blocked]);
+      }
+      seconds[blocked] = (double)(clock() - t0) / CLOCKS_PER_SEC;
+      fclose(scratch);
+    }
+    remove(scratchName);
+    arenaRelease(mark);
+    bool same = (memcmp(successors[0], successors[1], sizeof(successors[0])) == 0);
+    cout << "Level " << level << (full ? " full" : " empty") << ": " << len << " positions, loop "
+        << (seconds[0] > 0 ? len / seconds[0] : 0) << " positions/sec, tiles "
+        << (seconds[1] > 0 ? len / seconds[1] : 0) << " positions/sec"
+        << (same ? "" : ", successor counts differ") << endl;
+  }
+}
+
+/*
+ *
+ */
+void expandHalfLevel(bool full, FILE* fsource, FILE* fdest, FILE* fdestComplement, uint32_t * successors) {
+  expandHalfLevelRange(full, fsource, (uint32_t)-1, fdest, fdestComplement, successors);
 }
 
 clock_t ticks;
@@ -517,72 +1252,395 @@ void showPosition (uint32_t pos, bool full) {
  */
 void showLongFile(char * fname, bool full) {
   cout << "Showing file " << fname << endl;
-  FILE * f = fopen(fname, modeOpenReadBinary);
-  uint32_t ul;
-  if (f != 0) {
-    while (fread(&ul, sizeof(uint32_t), 1, f) > 0) {
-      showPosition(ul, full);
+  exportLevelFile(fname, full, 't', stdout);
+}
+
+/*
+ * Ways of sorting and uniq-ing a half level, from the fastest to the one needing least memory:
+ * read it whole and sort it in memory, split it by top bits into ranges sorted in memory
+ * one at a time, or sort it on file.
+ */
+enum sortMethod { SORT_IN_MEMORY, SORT_BUCKETED, SORT_EXTERNAL };
+static const char * sortMethodNames[] = {"in memory", "bucketed", "external"};
+
+/*
+ * The choices made for the next level by planLevel.
+ */
+struct levelPlan {
+  sortMethod method;
+  uint64_t estimate; // positions expected in each half of the level
+  int threads;
+  uint32_t bufSize; // elements of each buffer of the external sort and of longUniq
+  uint32_t ioBufferSize; // stdio buffer of the files the level is written to
+};
+
+static levelPlan plan = {SORT_EXTERNAL, 0, 1, bufSize, BUFSIZ};
+
+/*
+ * Number of top bits buckets a bucketed sort may need to hold at once: the largest
+ * bucket of a level is assumed to be no more than this many times the mean.
+ */
+static const int bucketSkew = 4;
+
+static sortMethod methodFor(uint64_t len) {
+  uint64_t bytes = len * sizeof(uint32_t);
+  if (memoryBudget == 0)
+    return SORT_EXTERNAL;
+  if (bytes <= memoryBudget)
+    return SORT_IN_MEMORY;
+  if (bytes * bucketSkew / topBitsBuckets <= memoryBudget)
+    return SORT_BUCKETED;
+  return SORT_EXTERNAL;
+}
+
+/*
+ * Estimate the size of the level after 'level' from the statistics of this level and
+ * of the one before: its positions times the mean number of successors of the
+ * previous level. Choose from it the sort method, the buffers and the threads.
+ */
+void planLevel(int level) {
+  uint64_t expanded = 0;
+  uint64_t successors = 0;
+  uint64_t unique = 0;
+  for (int full = 0; full < 2; full++) {
+    unique += stats[level][full].unique;
+    if (level > 0)
+      loadLevelStats(level - 1, full);
+    for (int i = 0; level > 0 && i < successorBuckets; i++) {
+      expanded += stats[level - 1][full].successors[i];
+      successors += (uint64_t)i * stats[level - 1][full].successors[i];
     }
-    fclose(f);
+  }
+  double branching = (expanded > 0) ? (double)successors / expanded : (double)nNormal / 4;
+  // the halves are about the same size, allow for some imbalance
+  plan.estimate = (uint64_t)(unique * branching * 0.6) + 1;
+  plan.method = methodFor(plan.estimate);
+  plan.threads = getThreadCount();
+  if (plan.method == SORT_EXTERNAL && memoryBudget > 0) {
+    uint64_t perThread = memoryBudget / plan.threads / (3 * sizeof(uint32_t));
+    plan.bufSize = (uint32_t)max((uint64_t)bufSize, min(perThread, (uint64_t)1 << 24));
+    while (plan.threads > 1 && (uint64_t)plan.threads * 3 * plan.bufSize * sizeof(uint32_t) > memoryBudget)
+      plan.threads--;
   } else {
-    cout << "cannot open file " << fname << endl;
+    plan.bufSize = bufSize;
+  }
+  uint64_t io = memoryBudget / 64;
+  plan.ioBufferSize = (uint32_t)max((uint64_t)BUFSIZ, min(io, (uint64_t)1 << 22));
+  cout << "Level " << level + 1 << " planned: about " << plan.estimate << " positions per half, "
+      << sortMethodNames[plan.method] << " sort, " << plan.threads << " threads, buffers of "
+      << plan.bufSize << " positions" << endl;
+}
+
+/*
+ * Write the sorted values of buf, skipping duplicates, and count them by top bits
+ * and in the checksums of the file. Return the number written.
+ */
+static uint32_t writeUnique(FILE * f, uint32_t * buf, uint32_t n, uint32_t * topBits, levelSums * sums) {
+  uint32_t u = 0;
+  for (uint32_t i = 0; i < n; i++) {
+    if (u == 0 || buf[i] != buf[u - 1]) {
+      buf[u++] = buf[i];
+      topBits[buf[i] >> 24]++;
+    }
   }
+  fwrite(buf, sizeof(uint32_t), u, f);
+  addLevelSums(sums, buf, u);
+  return u;
+}
+
+/*
+ * Sort and uniq a level file of len elements all in memory.
+ */
+static uint32_t sortInMemory(const char * fileName, uint32_t len, uint32_t * topBits) {
+  size_t mark = arenaMark();
+  uint32_t * buf = (uint32_t *)arenaAlloc(((size_t)len + 1) * sizeof(uint32_t));
+  FILE * f = fopen(fileName, modeOpenReadBinary);
+  len = fread(buf, sizeof(uint32_t), len, f);
+  fclose(f);
+  sort(buf, buf + len);
+  f = fopen(fileName, modeCreateWriteBinary);
+  levelSums * sums = startLevelSums();
+  uint32_t lu = writeUnique(f, buf, len, topBits, sums);
+  fclose(f);
+  finishLevelSums(sums, fileName);
+  arenaRelease(mark);
+  return lu;
+}
+
+/*
+ * Sort and uniq a level file by ranges of top bits: count the elements of each bucket,
+ * group consecutive buckets into ranges that fit the memory budget, copy each range
+ * to its own file, then sort each range in memory and append it to the level.
+ * A range is sized so that it fits the memory budget together with the read buffer
+ * and the buffers of the range files, which are held until the end.
+ * Return false, leaving the file untouched, if a single bucket does not fit.
+ */
+static bool sortBucketed(const char * fileName, uint32_t * topBits, uint32_t * unique) {
+  const uint32_t readSize = 1 << 16;
+  const uint32_t rangeBufSize = 1 << 10;
+  size_t mark = arenaMark();
+  uint32_t * rbuf = (uint32_t *)arenaAlloc(readSize * sizeof(uint32_t));
+  uint32_t counts[topBitsBuckets];
+  memset(counts, 0, sizeof(counts));
+  FILE * f = fopen(fileName, modeOpenReadBinary);
+  uint32_t rc;
+  while ((rc = fread(rbuf, sizeof(uint32_t), readSize, f)) > 0) {
+    for (uint32_t k = 0; k < rc; k++)
+      counts[rbuf[k] >> 24]++;
+  }
+  // at most one range per bucket, and one more element for the sort buffer
+  uint64_t overhead = readSize * sizeof(uint32_t) + sizeof(uint32_t)
+      + (uint64_t)topBitsBuckets * (rangeBufSize * sizeof(uint32_t) + L_tmpnam + sizeof(FILE *) + sizeof(uint32_t));
+  uint64_t cap = (memoryBudget > overhead) ? (memoryBudget - overhead) / sizeof(uint32_t) : 0;
+  int rangeOf[topBitsBuckets];
+  uint32_t rangeLen[topBitsBuckets];
+  int nRanges = 0;
+  uint64_t inRange = 0;
+  for (int b = 0; b < topBitsBuckets; b++) {
+    if (counts[b] > cap) {
+      fclose(f);
+      arenaRelease(mark);
+      return false;
+    }
+    if (nRanges == 0 || inRange + counts[b] > cap) {
+      rangeLen[nRanges++] = 0;
+      inRange = 0;
+    }
+    inRange += counts[b];
+    rangeLen[nRanges - 1] += counts[b];
+    rangeOf[b] = nRanges - 1;
+  }
+  char (* rangeNames)[L_tmpnam] = (char (*)[L_tmpnam])arenaAlloc(nRanges * L_tmpnam);
+  FILE ** rangeFiles = (FILE **)arenaAlloc(nRanges * sizeof(FILE *));
+  uint32_t * rangeBufs = (uint32_t *)arenaAlloc((size_t)nRanges * rangeBufSize * sizeof(uint32_t));
+  uint32_t * rangeFill = (uint32_t *)arenaAlloc(nRanges * sizeof(uint32_t));
+  for (int r = 0; r < nRanges; r++) {
+    tmpnam(rangeNames[r]);
+    rangeFiles[r] = fopen(rangeNames[r], modeCreateWriteBinary);
+    rangeFill[r] = 0;
+  }
+  fseek(f, 0, SEEK_SET);
+  while ((rc = fread(rbuf, sizeof(uint32_t), readSize, f)) > 0) {
+    for (uint32_t k = 0; k < rc; k++) {
+      int r = rangeOf[rbuf[k] >> 24];
+      uint32_t * rb = rangeBufs + (size_t)r * rangeBufSize;
+      rb[rangeFill[r]++] = rbuf[k];
+      if (rangeFill[r] == rangeBufSize) {
+        fwrite(rb, sizeof(uint32_t), rangeBufSize, rangeFiles[r]);
+        rangeFill[r] = 0;
+      }
+    }
+  }
+  fclose(f);
+  uint32_t largest = 0;
+  for (int r = 0; r < nRanges; r++) {
+    fwrite(rangeBufs + (size_t)r * rangeBufSize, sizeof(uint32_t), rangeFill[r], rangeFiles[r]);
+    fclose(rangeFiles[r]);
+    largest = max(largest, rangeLen[r]);
+  }
+  uint32_t * buf = (uint32_t *)arenaAlloc(((size_t)largest + 1) * sizeof(uint32_t));
+  f = fopen(fileName, modeCreateWriteBinary);
+  levelSums * sums = startLevelSums();
+  *unique = 0;
+  for (int r = 0; r < nRanges; r++) {
+    FILE * fr = fopen(rangeNames[r], modeOpenReadBinary);
+    uint32_t n = fread(buf, sizeof(uint32_t), rangeLen[r], fr);
+    fclose(fr);
+    remove(rangeNames[r]);
+    sort(buf, buf + n);
+    *unique += writeUnique(f, buf, n, topBits, sums);
+  }
+  fclose(f);
+  finishLevelSums(sums, fileName);
+  arenaRelease(mark);
+  return true;
 }
 
 /*
  * Sort and remove duplicates and optionally show a file
  * at a given level and central peg state.
+ * Return false, leaving the statistics of the file unwritten, if it could not be sorted.
  */
-void sortCompressShow (bool full, int level, bool show) {
+bool sortCompressShow (bool full, int level, bool show) {
   FILE * f = fopen(getName(level, full, false), modeOpenReadWriteBinary);
   fseek ( f, 0, SEEK_END );
   uint32_t len = ftell(f)/sizeof(uint32_t);
-  quickFileSort(f, 0, len - 1);
+  clearLevelStats(level, full);
+  sortMethod method = max(plan.method, methodFor(len)); // the estimate may have been too low
+  uint32_t lu = 0;
+  if (method == SORT_IN_MEMORY) {
+    fclose(f);
+    lu = sortInMemory(getName(level, full, false), len, levelTopBits(level, full));
+  } else if (method == SORT_BUCKETED) {
+    fclose(f);
+    if (!sortBucketed(getName(level, full, false), levelTopBits(level, full), &lu)) {
+      method = SORT_EXTERNAL;
+      f = fopen(getName(level, full, false), modeOpenReadWriteBinary);
+    }
+  }
+  if (method == SORT_EXTERNAL) {
+    bool sorted = quickFileSort(f, 0, len - 1, plan.threads, plan.bufSize);
+    fclose(f);
+    lu = sorted ? longUniq(getName(level, full, false), levelTopBits(level, full), plan.bufSize) : uniqFailed;
+    if (lu == uniqFailed) {
+      showTime();
+      cout << "Level " << level << (full ? " full" : " empty") << " could not be sorted" << endl;
+      return false;
+    }
+  }
   showTime();
-  cout << "Level " << level << (full ? " full" : " empty") << " sorted. Length = " << len << endl;
-  fclose(f);
-  uint32_t lu = longUniq(getName(level, full, false));
+  cout << "Level " << level << (full ? " full" : " empty") << " sorted " << sortMethodNames[method]
+      << ". Length = " << len << endl;
+  noteLevelCounts(level, full, len, lu);
+  writeLevelStats(level, full);
   showTime();
   cout << "Level " << level << (full ? " full" : " empty") << " uniq-ed. Length = " << lu << endl;
   if (show) {
     showLongFile(getName(level, full, false), full);
   }
+  return true;
 }
 
 
 /*
- * Expand a level into the next level
+ * Expand a level into the next level.
+ * Return false if the next level could not be built.
  */
-void expandLevel(int level, bool show) {
+bool expandLevel(int level, bool show) {
+  for (int full = 0; full < 2; full++) {
+    loadLevelStats(level, full);
+    memset(levelSuccessors(level, full), 0, successorBuckets * sizeof(uint32_t));
+  }
+  if (numaMode)
+    return expandLevelNuma(level, show);
+  planLevel(level);
   FILE * fer = fopen(getName(level, false, false), modeOpenReadBinary);
   FILE * ffr = fopen(getName(level, true, false), modeOpenReadBinary);
   FILE * few = fopen(getName(level+1, false, false), modeCreateWriteBinary);
   FILE * ffw = fopen(getName(level+1, true, false), modeCreateWriteBinary);
-  expandHalfLevel(false, fer, few, ffw);
+  setvbuf(few, NULL, _IOFBF, plan.ioBufferSize);
+  setvbuf(ffw, NULL, _IOFBF, plan.ioBufferSize);
+  expandHalfLevel(false, fer, few, ffw, levelSuccessors(level, false));
   showTime();
   cout << "Level " << level << " empty expanded" << endl;
-  expandHalfLevel(true, ffr, ffw, few);
+  expandHalfLevel(true, ffr, ffw, few, levelSuccessors(level, true));
   showTime();
   cout << "Level " << level << " full expanded" << endl;
   fclose(fer);
   fclose(ffr);
   fclose(few);
   fclose(ffw);
+  writeLevelStats(level, false);
+  writeLevelStats(level, true);
 #if 0
   showLongFile(getName(level+1, false), false);
   showLongFile(getName(level+1,true), true);
 #endif
-  sortCompressShow (false, level+1, show);
-  sortCompressShow (true, level+1, show);
+  return sortCompressShow (false, level+1, show) && sortCompressShow (true, level+1, show);
 }
 
 /*
  * Remove from level the positions that are not in the complement of complementLevel.
+ * The complement of a position with the centre hole full has the centre hole empty,
+ * so each half of level is intersected with the other half of complementLevel.
+ * Return false, leaving the half as it was, if a file could not be opened.
+ */
+bool intersectWithComplement(int level, int complementLevel) {
+  for (int i = 0; i < 2; i++) {
+    bool full = (i == 1);
+    char fileName[nameSize];
+    char complementName[nameSize];
+    char tempName[L_tmpnam];
+    strcpy(fileName, getName(level, full, false));
+    strcpy(complementName, getName(complementLevel, !full, false));
+    tmpnam(tempName);
+    memset(levelTopBits(level, full), 0, topBitsBuckets * sizeof(uint32_t));
+    uint32_t len = fileIntersection(fileName, complementName, true, tempName, levelTopBits(level, full));
+    if (len == setOpFailed) {
+      readLevelStats(level, full); // the top bits were cleared for the intersection
+      cout << "Level " << level << (full ? " full" : " empty") << " could not be intersected with complement of level "
+          << complementLevel << endl;
+      return false;
+    }
+    renameLevelFile(tempName, fileName);
+    noteLevelCounts(level, full, stats[level][full].generated, len);
+    writeLevelStats(level, full);
+    showTime();
+    cout << "Level " << level << (full ? " full" : " empty") << " intersected with complement of level "
+        << complementLevel << ". Length = " << len << endl;
+  }
+  return true;
+}
+
+
+/*
+ * Write the sorted unique positions of a level, split by the centre hole, as the seed of a search.
  */
-void intersectWithComplement(int level, int complementLevel) {
-	// TODO HERE;
+static void seedLevel(int level, const uint32_t * seeds, const bool * seedsFull, int n) {
+  for (int full = 0; full < 2; full++) {
+    size_t mark = arenaMark();
+    uint32_t * buf = (uint32_t *)arenaAlloc((n + 1) * sizeof(uint32_t));
+    int c = 0;
+    for (int i = 0; i < n; i++) {
+      if (seedsFull[i] == (full == 1))
+        buf[c++] = seeds[i];
+    }
+    qsort(buf, c, sizeof(uint32_t), unsignedLongCompare);
+    int u = 0;
+    for (int i = 0; i < c; i++) {
+      if (u == 0 || buf[i] != buf[u - 1])
+        buf[u++] = buf[i];
+    }
+    FILE * f = fopen(getName(level, full, false), modeCreateWriteBinary);
+    fwrite(buf, sizeof(uint32_t), u, f);
+    fclose(f);
+    levelSums * sums = startLevelSums();
+    addLevelSums(sums, buf, u);
+    finishLevelSums(sums, getName(level, full, false));
+    clearLevelStats(level, full);
+    noteLevelCounts(level, full, c, u);
+    for (int i = 0; i < u; i++)
+      levelTopBits(level, full)[buf[i] >> 24]++;
+    writeLevelStats(level, full); // replaces the statistics of any earlier search
+    arenaRelease(mark);
+  }
 }
 
+/*
+ * Expand the levels from firstLevel until the final level is reached.
+ * If meetComplement is set, the search started from the complement of its end,
+ * and from the middle level on each level is trimmed with the complement of its mirror level.
+ * Return false if a level turns out to be empty.
+ */
+static bool expandLevels(int firstLevel, int finalLevel, bool show, bool meetComplement) {
+  if (!checkLevel(firstLevel))
+    return false;
+  for (int i = firstLevel; i < finalLevel; i++) {
+    if (!expandLevel(i, show)) {
+      cout << "Level " << i + 1 << " could not be built, stopping" << endl;
+      return false;
+    }
+    // check each phase before the next one builds on it
+    if (!checkLevel(i + 1)) {
+      cout << "Level " << i + 1 << " is damaged, stopping" << endl;
+      return false;
+    }
+    if (meetComplement && i >= (NO_OF_HOLES - i)) {
+      if (!intersectWithComplement(i, NO_OF_HOLES-i) || !intersectWithComplement(NO_OF_HOLES-i, i)) {
+        cout << "Levels " << i << " and " << NO_OF_HOLES - i << " could not be trimmed, stopping" << endl;
+        return false;
+      }
+      if (!checkLevel(i) || !checkLevel(NO_OF_HOLES - i)) {
+        cout << "Levels " << i << " and " << NO_OF_HOLES - i << " are damaged, stopping" << endl;
+        return false;
+      }
+    }
+    arenaReport();
+    if (stats[i + 1][0].unique == 0 && stats[i + 1][1].unique == 0)
+      return false;
+  }
+  return true;
+}
 
 /*
  * Play starting from level 1 until the final level is reached.
@@ -591,20 +1649,95 @@ void findForwardReachablePositions(int finalLevel, bool show)
 {
   prepareAllMoves();
   // seed level 1 files
-  FILE * f = fopen(getName(1, false, false), modeCreateWriteBinary);
   uint32_t startPosition = 0xFFFFFFFF; // one position with the centre empty
-  fwrite(&startPosition, sizeof(uint32_t), 1, f);
-  fclose(f);
-  f = fopen(getName(1, true, false), modeCreateWriteBinary);
-  fclose(f); // no position with the centre full
+  bool startFull = false; // no position with the centre full
+  seedLevel(1, &startPosition, &startFull, 1);
+  startTime();
+  expandLevels(1, finalLevel, show, true);
+}
+
+/*
+ * Level of a position: the number of empty holes.
+ */
+static int levelOf(uint32_t pos, bool full) {
+  return NO_OF_HOLES - __builtin_popcount(pos) - (full ? 1 : 0);
+}
+
+/*
+ * Find the positions on the paths from a start position to any of a set of targets,
+ * all with the same number of pegs.
+ * The search runs forward from the start, and backward from the targets by running forward
+ * from their complements, since a move backward from a position is a move forward from
+ * its complement. Each side prunes its positions with pagoda functions of the other side's seeds.
+ * The two sides meet at a middle level, where the positions of the forward side that are
+ * complements of positions of the backward side are on a solution path.
+ * The levels are in files prefixed "fwd" and "bwd", the meeting positions in files prefixed "meet".
+ * Return the number of meeting positions.
+ */
+uint32_t findPathsBetween(uint32_t start, bool startFull, const uint32_t * targets, const bool * targetsFull,
+    int nTargets, bool show) {
+  prepareAllMoves();
+  int firstLevel = levelOf(start, startFull);
+  int lastLevel = levelOf(targets[0], targetsFull[0]);
+  for (int t = 1; t < nTargets; t++) {
+    if (levelOf(targets[t], targetsFull[t]) != lastLevel) {
+      cout << "all targets must have the same number of pegs" << endl;
+      return 0;
+    }
+  }
+  if (lastLevel <= firstLevel) {
+    cout << "the targets must have fewer pegs than the start" << endl;
+    return 0;
+  }
+  int meetLevel = (firstLevel + lastLevel) / 2;
+  size_t mark = arenaMark();
+  uint32_t * complements = (uint32_t *)arenaAlloc(nTargets * sizeof(uint32_t));
+  bool * complementsFull = (bool *)arenaAlloc(nTargets * sizeof(bool));
+  for (int t = 0; t < nTargets; t++) {
+    complements[t] = ~targets[t];
+    complementsFull[t] = !targetsFull[t];
+  }
+  uint32_t startComplement = ~start;
+  bool startComplementFull = !startFull;
   startTime();
-  for (int i = 1; i < finalLevel; i++) {
-    expandLevel(i, show);
-    if (i >= (NO_OF_HOLES - i)) {
-    	intersectWithComplement(i, NO_OF_HOLES-i);
-    	intersectWithComplement(NO_OF_HOLES-1, i);
+  cout << "Forward from level " << firstLevel << " to " << meetLevel << ", backward from level "
+      << NO_OF_HOLES - lastLevel << " to " << NO_OF_HOLES - meetLevel << endl;
+
+  setLevelNamePrefix("fwd");
+  preparePruning(targets, targetsFull, nTargets);
+  seedLevel(firstLevel, &start, &startFull, 1);
+  bool reached = canReachTargets(start, startFull) && expandLevels(firstLevel, meetLevel, show, false);
+
+  setLevelNamePrefix("bwd");
+  preparePruning(&startComplement, &startComplementFull, 1);
+  seedLevel(NO_OF_HOLES - lastLevel, complements, complementsFull, nTargets);
+  reached = expandLevels(NO_OF_HOLES - lastLevel, NO_OF_HOLES - meetLevel, show, false) && reached;
+  preparePruning(NULL, NULL, 0);
+
+  uint32_t total = 0;
+  for (int full = 0; full < 2 && reached; full++) {
+    char forwardName[nameSize];
+    char backwardName[nameSize];
+    char meetName[nameSize];
+    setLevelNamePrefix("fwd");
+    strcpy(forwardName, getName(meetLevel, full, false));
+    setLevelNamePrefix("bwd");
+    strcpy(backwardName, getName(NO_OF_HOLES - meetLevel, !full, false));
+    setLevelNamePrefix("meet");
+    strcpy(meetName, getName(meetLevel, full, false));
+    uint32_t met = fileIntersection(forwardName, backwardName, true, meetName, levelTopBits(meetLevel, full));
+    if (met == setOpFailed) {
+      cout << "Level " << meetLevel << (full ? " full" : " empty") << ": the searches could not be met" << endl;
+      total = 0;
+      break;
     }
+    total += met;
   }
+  setLevelNamePrefix("");
+  arenaRelease(mark);
+  showTime();
+  cout << "Level " << meetLevel << ": " << total << " positions on a path from the start to the targets" << endl;
+  return total;
 }
 
 /*
@@ -635,6 +1768,24 @@ bool valueFoundRecurse(FILE* f, uint32_t lo, uint32_t hi, uint32_t value) {
  * Check if a value is found in a level file
  */
 bool valueFound(int level, bool full, uint32_t value) {
+  bool inRanked;
+  if (rankedValueFound(level, full, value, &inRanked))
+    return inRanked; // the level has a rank form, no need to search the file
+  // a binary search on an unsorted file gives wrong answers, check each file before its first use
+  static char checked[2 * (NO_OF_HOLES + 1)][nameSize];
+  static int nChecked = 0;
+  const char * fileName = getName(level, full, false);
+  int c = 0;
+  while (c < nChecked && strcmp(checked[c], fileName) != 0)
+    c++;
+  if (c == nChecked) {
+    if (!checkLevelFile(level, full, true)) {
+      cout << "cannot search a damaged level file" << endl;
+      return false;
+    }
+    if (nChecked < 2 * (NO_OF_HOLES + 1))
+      strcpy(checked[nChecked++], getName(level, full, false));
+  }
   FILE * f = fopen(getName(level, full, false), modeOpenReadBinary);
   if (f == NULL) {
     cout << "cannot open move file";
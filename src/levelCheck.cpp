@@ -0,0 +1,466 @@
+/*
+ * levelCheck.cpp
+ *
+ * Integrity checks of level files: each position must be greater than the one
+ * before it and have the number of pegs of its level, counting the centre hole
+ * of the file's half, and the checksums of its blocks must match those recorded
+ * when the file was written.
+ * The writers of level files record the checksum and the first and last position of
+ * each block as they write it, so the check made after each phase of a search reads
+ * the block boundaries and one sample block; the full check reads every block.
+ * A file is split among threads, each reading its own blocks with positioned reads.
+ */
+#include <iostream>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+using namespace std;
+
+extern const char * modeOpenReadBinary;
+extern char * getName(int level, bool centreHoleFull, bool isTrimmed);
+extern int getThreadCount();
+extern bool readElements(int fd, uint32_t * buf, uint32_t at, uint32_t n);
+extern void * arenaAlloc(size_t bytes);
+extern size_t arenaMark();
+extern void arenaRelease(size_t mark);
+
+static const int NO_OF_HOLES = 33;
+static const uint32_t checkBlockSize = 1 << 16; // positions per checksum
+static const int maxCheckThreads = 64;
+static const int sumNameSize = 96; // room for the level file names and their share and merge suffixes
+
+/*
+ * The blocks of a file checked by one thread, and what it found.
+ */
+struct checkPart {
+  int fd;
+  bool full;
+  int pegs;
+  uint32_t len;
+  uint32_t firstBlock;
+  uint32_t endBlock;
+  uint64_t * sums; // checksum of each block of the file
+  uint32_t * firsts; // first position of each block
+  uint32_t * lasts; // last position of each block
+  uint32_t * buf;
+  uint32_t errors;
+  uint32_t firstError; // index of the first position found wrong
+  uint32_t badValue;
+};
+
+/*
+ * The checksum of a block: FNV-1a over its positions.
+ */
+static const uint64_t sumStart = 0xcbf29ce484222325ULL;
+
+static inline uint64_t sumStep(uint64_t h, uint32_t v) {
+  return (h ^ v) * 0x100000001b3ULL;
+}
+
+static void noteError(checkPart * part, uint32_t at, uint32_t value) {
+  if (part->errors++ == 0) {
+    part->firstError = at;
+    part->badValue = value;
+  }
+}
+
+static void * checkBlocks(void * arg) {
+  checkPart * part = (checkPart *)arg;
+  uint32_t prev = 0;
+  bool havePrev = false;
+  if (part->firstBlock > 0 && part->firstBlock < part->endBlock)
+    havePrev = readElements(part->fd, &prev, part->firstBlock * checkBlockSize - 1, 1);
+  for (uint32_t b = part->firstBlock; b < part->endBlock; b++) {
+    uint32_t at = b * checkBlockSize;
+    uint32_t n = (part->len - at < checkBlockSize) ? part->len - at : checkBlockSize;
+    if (!readElements(part->fd, part->buf, at, n)) {
+      noteError(part, at, 0);
+      return NULL;
+    }
+    uint64_t h = sumStart;
+    uint32_t centre = part->full ? 1 : 0;
+    for (uint32_t i = 0; i < n; i++) {
+      uint32_t v = part->buf[i];
+      if ((havePrev && v <= prev) || __builtin_popcount(v) + centre != (uint32_t)part->pegs)
+        noteError(part, at + i, v);
+      h = sumStep(h, v);
+      prev = v;
+      havePrev = true;
+    }
+    part->sums[b] = h;
+    part->firsts[b] = part->buf[0];
+    part->lasts[b] = part->buf[n - 1];
+  }
+  return NULL;
+}
+
+/*
+ * Name of the file holding the block checksums of a level file: the .gam extension
+ * of a level file is replaced, other names, such as those of node shares, are extended.
+ */
+static char * getSumName(const char * fileName) {
+  static char name[sumNameSize];
+  snprintf(name, sizeof(name) - 4, "%s", fileName);
+  size_t n = strlen(name);
+  if (n >= 4 && strcmp(name + n - 4, ".gam") == 0)
+    n -= 4;
+  strcpy(name + n, ".sum");
+  return name;
+}
+
+static void writeSums(const char * fileName, uint32_t len, const uint64_t * sums, const uint32_t * firsts,
+    const uint32_t * lasts, uint32_t nBlocks) {
+  FILE * f = fopen(getSumName(fileName), "w");
+  if (f == NULL) {
+    cout << "cannot write checksums of " << fileName << endl;
+    return;
+  }
+  fprintf(f, "length %u\nblockSize %u\nblocks %u\n", len, checkBlockSize, nBlocks);
+  for (uint32_t b = 0; b < nBlocks; b++)
+    fprintf(f, "%016llx %08x %08x\n", (unsigned long long)sums[b], firsts[b], lasts[b]);
+  fclose(f);
+}
+
+/*
+ * The checksums and block boundaries recorded for a file, allocated from the arena.
+ * Return false if there are none or they cannot be read.
+ */
+static bool readSums(const char * fileName, uint32_t * len, uint32_t * nBlocks, uint64_t ** sums,
+    uint32_t ** firsts, uint32_t ** lasts) {
+  FILE * f = fopen(getSumName(fileName), "r");
+  if (f == NULL)
+    return false;
+  uint32_t blockSize;
+  bool ok = (fscanf(f, " length %u blockSize %u blocks %u", len, &blockSize, nBlocks) == 3
+      && blockSize == checkBlockSize && *nBlocks == (*len + checkBlockSize - 1) / checkBlockSize);
+  if (ok) {
+    *sums = (uint64_t *)arenaAlloc((*nBlocks + 1) * sizeof(uint64_t));
+    *firsts = (uint32_t *)arenaAlloc((*nBlocks + 1) * sizeof(uint32_t));
+    *lasts = (uint32_t *)arenaAlloc((*nBlocks + 1) * sizeof(uint32_t));
+    for (uint32_t b = 0; b < *nBlocks && ok; b++) {
+      unsigned long long s;
+      ok = (fscanf(f, "%llx %x %x", &s, &(*firsts)[b], &(*lasts)[b]) == 3);
+      (*sums)[b] = s;
+    }
+  }
+  fclose(f);
+  return ok;
+}
+
+/*
+ * Compare the checksums and block boundaries with those recorded for the file.
+ * Return the number of blocks that differ, or 0 if none were recorded.
+ */
+static uint32_t compareSums(const char * fileName, uint32_t len, const uint64_t * sums, const uint32_t * firsts,
+    const uint32_t * lasts, uint32_t nBlocks) {
+  FILE * f = fopen(getSumName(fileName), "r");
+  if (f == NULL) {
+    cout << "no checksums recorded for " << fileName << endl;
+    return 0;
+  }
+  fclose(f);
+  size_t mark = arenaMark();
+  uint32_t recordedLen, recordedBlocks;
+  uint64_t * recordedSums;
+  uint32_t * recordedFirsts;
+  uint32_t * recordedLasts;
+  uint32_t bad = 0;
+  if (!readSums(fileName, &recordedLen, &recordedBlocks, &recordedSums, &recordedFirsts, &recordedLasts)
+      || recordedLen != len || recordedBlocks != nBlocks) {
+    cout << fileName << ": length differs from the one recorded" << endl;
+    bad = 1;
+  } else {
+    for (uint32_t b = 0; b < nBlocks; b++) {
+      if (recordedSums[b] != sums[b] || recordedFirsts[b] != firsts[b] || recordedLasts[b] != lasts[b]) {
+        if (bad++ == 0)
+          cout << fileName << ": block " << b << " differs from its checksum" << endl;
+      }
+    }
+  }
+  arenaRelease(mark);
+  return bad;
+}
+
+/*
+ * A digest of the checksums recorded for a level file, which changes whenever the
+ * file is written again with other contents. Return false if none are recorded.
+ */
+bool levelFileDigest(const char * fileName, uint64_t * digest) {
+  size_t mark = arenaMark();
+  uint32_t len, nBlocks;
+  uint64_t * sums;
+  uint32_t * firsts;
+  uint32_t * lasts;
+  bool ok = readSums(fileName, &len, &nBlocks, &sums, &firsts, &lasts);
+  if (ok) {
+    uint64_t h = sumStep(sumStart, len);
+    for (uint32_t b = 0; b < nBlocks; b++)
+      h = sumStep(sumStep(h, (uint32_t)sums[b]), (uint32_t)(sums[b] >> 32));
+    *digest = h;
+  }
+  arenaRelease(mark);
+  return ok;
+}
+
+/*
+ * Checksums and boundaries of the blocks of a level file, accumulated by its writer.
+ * The number of blocks is not known in advance, so the arrays are grown with realloc
+ * rather than taken from an arena.
+ */
+struct levelSums {
+  uint32_t len;
+  uint64_t sum; // of the block being written
+  uint32_t capacity;
+  uint64_t * sums;
+  uint32_t * firsts;
+  uint32_t * lasts;
+};
+
+levelSums * startLevelSums() {
+  levelSums * s = (levelSums *)malloc(sizeof(levelSums));
+  memset(s, 0, sizeof(*s));
+  return s;
+}
+
+/*
+ * Account for the next n positions written to the file.
+ */
+void addLevelSums(levelSums * s, const uint32_t * values, uint32_t n) {
+  for (uint32_t i = 0; i < n; i++) {
+    uint32_t b = s->len / checkBlockSize;
+    if (s->len % checkBlockSize == 0) {
+      if (b >= s->capacity) {
+        s->capacity = 2 * s->capacity + 16;
+        s->sums = (uint64_t *)realloc(s->sums, s->capacity * sizeof(uint64_t));
+        s->firsts = (uint32_t *)realloc(s->firsts, s->capacity * sizeof(uint32_t));
+        s->lasts = (uint32_t *)realloc(s->lasts, s->capacity * sizeof(uint32_t));
+      }
+      s->sum = sumStart;
+      s->firsts[b] = values[i];
+    }
+    s->sum = sumStep(s->sum, values[i]);
+    s->sums[b] = s->sum;
+    s->lasts[b] = values[i];
+    s->len++;
+  }
+}
+
+/*
+ * Record the sums accumulated as those of fileName, unless it is NULL, and free them.
+ */
+void finishLevelSums(levelSums * s, const char * fileName) {
+  if (fileName != NULL)
+    writeSums(fileName, s->len, s->sums, s->firsts, s->lasts, (s->len + checkBlockSize - 1) / checkBlockSize);
+  free(s->sums);
+  free(s->firsts);
+  free(s->lasts);
+  free(s);
+}
+
+/*
+ * Rename or remove a level file together with its checksums.
+ */
+void renameLevelFile(const char * from, const char * to) {
+  char sumName[sumNameSize];
+  snprintf(sumName, sizeof(sumName), "%s", getSumName(from));
+  remove(to);
+  rename(from, to);
+  rename(sumName, getSumName(to));
+}
+
+void removeLevelFile(const char * fileName) {
+  remove(fileName);
+  remove(getSumName(fileName));
+}
+
+
+/*
+ * Check the file of one half of a level: strictly ascending positions, each with 33 - level pegs.
+ * If verifySums is set the block checksums are compared with the recorded ones,
+ * else they are recorded.
+ * Problems are shown; return true if there are none.
+ */
+bool checkNamedLevelFile(const char * fileName, int level, bool full, bool verifySums) {
+  FILE * f = fopen(fileName, modeOpenReadBinary);
+  if (f == NULL) {
+    cout << "cannot open file " << fileName << endl;
+    return false;
+  }
+  fseek(f, 0, SEEK_END);
+  uint32_t len = ftell(f) / sizeof(uint32_t);
+  uint32_t nBlocks = (len + checkBlockSize - 1) / checkBlockSize;
+  int nThreads = getThreadCount();
+  if (nThreads > maxCheckThreads)
+    nThreads = maxCheckThreads;
+  if ((uint32_t)nThreads > nBlocks)
+    nThreads = (nBlocks > 0) ? nBlocks : 1;
+  size_t mark = arenaMark();
+  uint64_t * sums = (uint64_t *)arenaAlloc((nBlocks + 1) * sizeof(uint64_t));
+  uint32_t * firsts = (uint32_t *)arenaAlloc((nBlocks + 1) * sizeof(uint32_t));
+  uint32_t * lasts = (uint32_t *)arenaAlloc((nBlocks + 1) * sizeof(uint32_t));
+  checkPart parts[maxCheckThreads];
+  pthread_t threads[maxCheckThreads];
+  for (int t = 0; t < nThreads; t++) {
+    checkPart * part = &parts[t];
+    part->fd = fileno(f);
+    part->full = full;
+    part->pegs = NO_OF_HOLES - level;
+    part->len = len;
+    part->firstBlock = (uint64_t)nBlocks * t / nThreads;
+    part->endBlock = (uint64_t)nBlocks * (t + 1) / nThreads;
+    part->sums = sums;
+    part->firsts = firsts;
+    part->lasts = lasts;
+    part->buf = (uint32_t *)arenaAlloc(checkBlockSize * sizeof(uint32_t));
+    part->errors = 0;
+    if (t > 0)
+      pthread_create(&threads[t], NULL, checkBlocks, part);
+  }
+  checkBlocks(&parts[0]);
+  for (int t = 1; t < nThreads; t++)
+    pthread_join(threads[t], NULL);
+  fclose(f);
+  uint32_t errors = 0;
+  for (int t = 0; t < nThreads; t++) {
+    if (parts[t].errors > 0 && errors == 0) {
+      cout << fileName << ": position " << parts[t].firstError << " (" << hex
+          << parts[t].badValue << dec << ") is out of order or has the wrong number of pegs" << endl;
+    }
+    errors += parts[t].errors;
+  }
+  if (errors > 0)
+    cout << fileName << ": " << errors << " wrong positions of " << len << endl;
+  if (verifySums)
+    errors += compareSums(fileName, len, sums, firsts, lasts, nBlocks);
+  else if (errors == 0)
+    writeSums(fileName, len, sums, firsts, lasts, nBlocks);
+  arenaRelease(mark);
+  return errors == 0;
+}
+
+/*
+ * Check a level file against the block boundaries recorded when it was written:
+ * its length, and the first and last position of each block, which must have the
+ * pegs of the level and ascend from block to block. Only two positions per block are
+ * read, plus one block, a different one at each call, read in full and checked for
+ * order, pegs and its recorded checksum.
+ * A file written without recording its sums is checked in full, which records them.
+ * Problems are shown; return true if there are none.
+ */
+bool checkLevelFileBounds(const char * fileName, int level, bool full) {
+  size_t mark = arenaMark();
+  uint32_t recordedLen, nBlocks;
+  uint64_t * sums;
+  uint32_t * firsts;
+  uint32_t * lasts;
+  if (!readSums(fileName, &recordedLen, &nBlocks, &sums, &firsts, &lasts)) {
+    arenaRelease(mark);
+    return checkNamedLevelFile(fileName, level, full, false);
+  }
+  FILE * f = fopen(fileName, modeOpenReadBinary);
+  if (f == NULL) {
+    cout << "cannot open file " << fileName << endl;
+    arenaRelease(mark);
+    return false;
+  }
+  fseek(f, 0, SEEK_END);
+  uint32_t len = ftell(f) / sizeof(uint32_t);
+  bool ok = (len == recordedLen);
+  if (!ok)
+    cout << fileName << ": length " << len << " differs from the recorded " << recordedLen << endl;
+  uint32_t pegs = NO_OF_HOLES - level - (full ? 1 : 0);
+  for (uint32_t b = 0; b < nBlocks && ok; b++) {
+    uint32_t at = b * checkBlockSize;
+    uint32_t n = (len - at < checkBlockSize) ? len - at : checkBlockSize;
+    uint32_t first, last;
+    if (!readElements(fileno(f), &first, at, 1) || !readElements(fileno(f), &last, at + n - 1, 1)
+        || first != firsts[b] || last != lasts[b]) {
+      cout << fileName << ": block " << b << " differs from its recorded boundaries" << endl;
+      ok = false;
+    } else if ((uint32_t)__builtin_popcount(first) != pegs || (uint32_t)__builtin_popcount(last) != pegs
+        || (n > 1 && first >= last) || (b > 0 && lasts[b - 1] >= first)) {
+      cout << fileName << ": block " << b << " is out of order or has the wrong number of pegs" << endl;
+      ok = false;
+    }
+  }
+  static uint32_t sampleCount = 0;
+  if (ok && nBlocks > 0) {
+    uint32_t b = (uint32_t)((sampleCount++ * 2654435761u) % nBlocks);
+    checkPart part;
+    part.fd = fileno(f);
+    part.full = full;
+    part.pegs = NO_OF_HOLES - level;
+    part.len = len;
+    part.firstBlock = b;
+    part.endBlock = b + 1;
+    part.sums = (uint64_t *)arenaAlloc((nBlocks + 1) * sizeof(uint64_t));
+    part.firsts = (uint32_t *)arenaAlloc((nBlocks + 1) * sizeof(uint32_t));
+    part.lasts = (uint32_t *)arenaAlloc((nBlocks + 1) * sizeof(uint32_t));
+    part.buf = (uint32_t *)arenaAlloc(checkBlockSize * sizeof(uint32_t));
+    part.errors = 0;
+    checkBlocks(&part);
+    if (part.errors > 0) {
+      cout << fileName << ": position " << part.firstError << " (" << hex << part.badValue << dec
+          << ") is out of order or has the wrong number of pegs" << endl;
+      ok = false;
+    } else if (part.sums[b] != sums[b]) {
+      cout << fileName << ": block " << b << " differs from its checksum" << endl;
+      ok = false;
+    }
+  }
+  fclose(f);
+  arenaRelease(mark);
+  return ok;
+}
+
+bool checkLevelFile(int level, bool full, bool verifySums) {
+  char fileName[sumNameSize];
+  snprintf(fileName, sizeof(fileName), "%s", getName(level, full, false));
+  return checkNamedLevelFile(fileName, level, full, verifySums);
+}
+
+/*
+ * Check both halves of a level after it has been written, against the block
+ * boundaries recorded by its writer.
+ */
+bool checkLevel(int level) {
+  char fileName[sumNameSize];
+  bool ok = true;
+  for (int full = 0; full < 2; full++) {
+    snprintf(fileName, sizeof(fileName), "%s", getName(level, full, false));
+    ok = checkLevelFileBounds(fileName, level, full) && ok;
+  }
+  return ok;
+}
+
+/*
+ * Verify both halves of levels firstLevel to finalLevel against their checksums,
+ * showing the speed of the check. Return the number of files with problems.
+ */
+int verifyLevels(int firstLevel, int finalLevel) {
+  int bad = 0;
+  for (int level = firstLevel; level <= finalLevel; level++) {
+    for (int full = 0; full < 2; full++) {
+      struct timeval t0, t1;
+      gettimeofday(&t0, NULL);
+      bool ok = checkLevelFile(level, full, true);
+      gettimeofday(&t1, NULL);
+      double seconds = (t1.tv_sec - t0.tv_sec) + (t1.tv_usec - t0.tv_usec) / 1e6;
+      FILE * f = fopen(getName(level, full, false), modeOpenReadBinary);
+      double mb = 0;
+      if (f != NULL) {
+        fseek(f, 0, SEEK_END);
+        mb = ftell(f) / 1048576.0;
+        fclose(f);
+      }
+      cout << getName(level, full, false) << (ok ? " ok" : " BAD") << ", " << mb << " MB in " << seconds
+          << " sec" << endl;
+      bad += ok ? 0 : 1;
+    }
+  }
+  return bad;
+}
@@ -0,0 +1,195 @@
+/*
+ * levelExport.cpp
+ *
+ * Bulk export of level files as board pictures, CSV lines or compact binary boards.
+ */
+#include <iostream>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+using namespace std;
+
+extern int positions[7][7];
+extern const char * modeOpenReadBinary;
+extern void * arenaAlloc(size_t bytes);
+extern size_t arenaMark();
+extern void arenaRelease(size_t mark);
+
+static const uint32_t exportReadSize = 1 << 16; // positions read per block
+static const uint32_t exportWriteSize = 1 << 20; // bytes written per block
+
+/*
+ * A board is decoded into seven row bytes packed in a uint64_t, byte i holding row i,
+ * with bit j of a row set if there is a peg in column j.
+ * rowsOfByte[k][v] holds the rows for the value v of byte k of a position, so
+ * a whole board is the OR of four table entries plus the centre hole.
+ */
+static uint64_t rowsOfByte[4][256];
+static const uint64_t centreRowBit = ((uint64_t)1 << 3) << (3 * 8);
+
+/*
+ * Text of a row for each value of its row byte, for the three-hole wide rows
+ * of the arms and for the full-width rows, each with a trailing separator.
+ */
+static char rowText[2][128][8];
+static char csvRowText[2][128][8];
+
+static bool tablesReady = false;
+
+static void prepareExportTables() {
+  memset(rowsOfByte, 0, sizeof(rowsOfByte));
+  for (int i = 0; i < 7; i++) {
+    for (int j = 0; j < 7; j++) {
+      int h = positions[i][j];
+      if (h < 0)
+        continue;
+      uint64_t bit = ((uint64_t)1 << j) << (i * 8);
+      for (int v = 0; v < 256; v++) {
+        if (v & (1 << (h % 8)))
+          rowsOfByte[h / 8][v] |= bit;
+      }
+    }
+  }
+  for (int wide = 0; wide < 2; wide++) {
+    for (int v = 0; v < 128; v++) {
+      for (int j = 0; j < 7; j++) {
+        bool onBoard = wide || (j >= 2 && j <= 4);
+        char c = (v & (1 << j)) ? 'X' : '.';
+        rowText[wide][v][j] = onBoard ? c : ' ';
+        csvRowText[wide][v][j] = onBoard ? c : '-';
+      }
+      rowText[wide][v][7] = '\n';
+      csvRowText[wide][v][7] = '/';
+    }
+  }
+  tablesReady = true;
+}
+
+/*
+ * Return the board as seven packed row bytes.
+ */
+uint64_t decodeBoard(uint32_t pos, bool full) {
+  if (!tablesReady)
+    prepareExportTables();
+  return rowsOfByte[0][pos & 0xFF] | rowsOfByte[1][(pos >> 8) & 0xFF]
+      | rowsOfByte[2][(pos >> 16) & 0xFF] | rowsOfByte[3][pos >> 24]
+      | (full ? centreRowBit : 0);
+}
+
+/*
+ * Filter and sampling applied by exportLevelFile.
+ * Only positions with between minRegionPegs and maxRegionPegs pegs in the holes
+ * of regionMask (plus the centre hole if regionCentre) are exported, and of those
+ * only one every sampleEvery.
+ */
+static uint32_t regionMask = 0;
+static bool regionCentre = false;
+static int minRegionPegs = 0;
+static int maxRegionPegs = 33;
+static uint32_t sampleEvery = 1;
+
+void setExportFilter(uint32_t mask, bool centre, int minPegs, int maxPegs) {
+  regionMask = mask;
+  regionCentre = centre;
+  minRegionPegs = minPegs;
+  maxRegionPegs = maxPegs;
+}
+
+void setExportSampling(uint32_t every) {
+  sampleEvery = (every > 0) ? every : 1;
+}
+
+static const char hexDigits[] = "0123456789abcdef";
+
+/*
+ * Append the encoding of one position to p, return the new end.
+ * Formats: 't' board picture as shown by showPosition,
+ * 'c' CSV line "position,centre,pegs,rows" with rows separated by '/'
+ *     (the header line is left to the caller, so several files can be concatenated),
+ * 'b' seven row bytes.
+ */
+static char * encodePosition(char * p, uint32_t pos, bool full, char format) {
+  uint64_t rows = decodeBoard(pos, full);
+  switch (format) {
+  case 'b':
+    for (int i = 0; i < 7; i++)
+      *p++ = (char)(rows >> (i * 8));
+    break;
+  case 'c': {
+    for (int k = 7; k >= 0; k--)
+      *p++ = hexDigits[(pos >> (k * 4)) & 0xF];
+    *p++ = ',';
+    *p++ = full ? '1' : '0';
+    *p++ = ',';
+    int pegs = __builtin_popcount(pos) + (full ? 1 : 0);
+    if (pegs >= 10)
+      *p++ = '0' + pegs / 10;
+    *p++ = '0' + pegs % 10;
+    *p++ = ',';
+    for (int i = 0; i < 7; i++) {
+      memcpy(p, csvRowText[i >= 2 && i <= 4][(rows >> (i * 8)) & 0x7F], 8);
+      p += 8;
+    }
+    p[-1] = '\n';
+    break;
+  }
+  default:
+    *p++ = '\n';
+    for (int i = 0; i < 7; i++) {
+      memcpy(p, rowText[i >= 2 && i <= 4][(rows >> (i * 8)) & 0x7F], 8);
+      p += 8;
+    }
+    break;
+  }
+  return p;
+}
+
+/*
+ * Write the positions of a level file to out in the given format,
+ * applying the current filter and sampling. Return the number of positions written.
+ */
+uint32_t exportLevelFile(const char * fileName, bool full, char format, FILE * out) {
+  FILE * f = fopen(fileName, modeOpenReadBinary);
+  if (f == NULL) {
+    cout << "cannot open file " << fileName << endl;
+    return 0;
+  }
+  if (!tablesReady)
+    prepareExportTables();
+  size_t mark = arenaMark();
+  uint32_t * rbuf = (uint32_t *)arenaAlloc(exportReadSize * sizeof(uint32_t));
+  char * wbuf = (char *)arenaAlloc(exportWriteSize);
+  char * wend = wbuf;
+  uint32_t centreCount = (regionCentre && full) ? 1 : 0;
+  bool filtering = (regionMask != 0 || regionCentre);
+  uint32_t passed = 0;
+  uint32_t written = 0;
+  while (1) {
+    uint32_t rc = fread(rbuf, sizeof(uint32_t), exportReadSize, f);
+    if (rc == 0)
+      break;
+    for (uint32_t k = 0; k < rc; k++) {
+      uint32_t pos = rbuf[k];
+      if (filtering) {
+        int pegs = __builtin_popcount(pos & regionMask) + centreCount;
+        if (pegs < minRegionPegs || pegs > maxRegionPegs)
+          continue;
+      }
+      if (passed++ % sampleEvery != 0)
+        continue;
+      if (wend - wbuf > (long)exportWriteSize - 80) {
+        fwrite(wbuf, 1, wend - wbuf, out);
+        wend = wbuf;
+      }
+      wend = encodePosition(wend, pos, full, format);
+      written++;
+    }
+  }
+  if (wend > wbuf)
+    fwrite(wbuf, 1, wend - wbuf, out);
+  fflush(out);
+  fclose(f);
+  arenaRelease(mark);
+  return written;
+}
@@ -0,0 +1,345 @@
+/*
+ * numa.cpp
+ *
+ * NUMA-aware expansion of a level: the positions of each level are split across
+ * the nodes of the machine, and each node expands, sorts and uniqs its share with
+ * threads pinned to its own processors, so that buffers are first touched, and
+ * therefore placed, on the node that uses them.
+ * The sorted shares are then merged into the level files.
+ */
+#include <iostream>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/time.h>
+using namespace std;
+
+extern const char * modeCreateWriteBinary;
+extern const char * modeOpenReadBinary;
+extern const char * modeOpenReadWriteBinary;
+extern char * getName(int level, bool centreHoleFull, bool isTrimmed);
+extern void expandHalfLevelRange(bool full, FILE* fsource, uint32_t count, FILE* fdest, FILE* fdestComplement,
+    uint32_t * successors);
+extern bool quickFileSort(FILE * f, uint32_t lo, uint32_t hi, int nThreads, uint32_t bufferSize);
+extern uint32_t longUniq(const char * fileName, uint32_t * topBits, uint32_t bufferSize);
+extern const uint32_t bufSize;
+extern const uint32_t uniqFailed;
+extern const uint32_t setOpFailed;
+extern uint32_t fileUnion(const char * aName, const char * bName, bool complementB, const char * outName,
+    uint32_t * topBits);
+extern void renameLevelFile(const char * from, const char * to);
+extern void removeLevelFile(const char * fileName);
+extern void * arenaAlloc(size_t bytes);
+extern size_t arenaMark();
+extern void arenaRelease(size_t mark);
+extern void arenaUseNode(int node);
+extern const int successorBuckets;
+extern const int topBitsBuckets;
+extern uint32_t * levelSuccessors(int level, bool full);
+extern uint32_t * levelTopBits(int level, bool full);
+extern void clearLevelStats(int level, bool full);
+extern void noteLevelCounts(int level, bool full, uint32_t generated, uint32_t unique);
+extern void writeLevelStats(int level, bool full);
+extern void showTime();
+extern void showLongFile(char * fname, bool full);
+
+static const int maxNodes = 8;
+static const int shareNameSize = 64; // the size of the level file names
+static const int maxNodeCpus = 256;
+
+struct numaNode {
+  int id; // number of the node for the system, -1 if the topology is not exposed
+  int cpuCount;
+  int cpus[maxNodeCpus];
+};
+
+static numaNode nodes[maxNodes];
+static int nodeCount = 0;
+
+/*
+ * Parse a Linux cpu list such as "0-7,16-23" into the processors of a node.
+ */
+static void parseCpuList(const char * list, numaNode * node) {
+  node->cpuCount = 0;
+  const char * p = list;
+  while (*p >= '0' && *p <= '9') {
+    char * end;
+    int first = strtol(p, &end, 10);
+    int last = first;
+    if (*end == '-')
+      last = strtol(end + 1, &end, 10);
+    for (int c = first; c <= last && node->cpuCount < maxNodeCpus; c++)
+      node->cpus[node->cpuCount++] = c;
+    p = (*end == ',') ? end + 1 : end;
+  }
+}
+
+/*
+ * Find the nodes and their processors. The online nodes need not be numbered
+ * contiguously, so they are read from the node list rather than probed in turn.
+ * Where the topology is not exposed the whole machine is a single node.
+ */
+static void findNumaNodes() {
+  nodeCount = 0;
+  char list[1024];
+  numaNode online;
+  online.cpuCount = 0;
+  FILE * fo = fopen("/sys/devices/system/node/online", "r");
+  if (fo != NULL) {
+    if (fgets(list, sizeof(list), fo) != NULL)
+      parseCpuList(list, &online); // the same syntax as a cpu list
+    fclose(fo);
+  }
+  for (int i = 0; i < online.cpuCount && nodeCount < maxNodes; i++) {
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", online.cpus[i]);
+    FILE * f = fopen(path, "r");
+    if (f == NULL)
+      continue;
+    if (fgets(list, sizeof(list), f) != NULL) {
+      nodes[nodeCount].id = online.cpus[i];
+      parseCpuList(list, &nodes[nodeCount]);
+      if (nodes[nodeCount].cpuCount > 0) // memory-only nodes have no processors
+        nodeCount++;
+    }
+    fclose(f);
+  }
+  if (nodeCount == 0) {
+    int n = sysconf(_SC_NPROCESSORS_ONLN);
+    nodes[0].id = -1;
+    nodes[0].cpuCount = 0;
+    for (int c = 0; c < n && c < maxNodeCpus; c++)
+      nodes[0].cpus[nodes[0].cpuCount++] = c;
+    if (nodes[0].cpuCount == 0)
+      nodes[0].cpus[nodes[0].cpuCount++] = 0;
+    nodeCount = 1;
+  }
+}
+
+/*
+ * Restrict the calling thread, and the threads it creates, to the processors of a node.
+ */
+static void pinToNode(const numaNode * node) {
+#ifdef CPU_SET
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (int i = 0; i < node->cpuCount; i++)
+    CPU_SET(node->cpus[i], &set);
+  if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+    cout << "cannot pin thread to node" << endl;
+#endif
+}
+
+static double wallClock() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/*
+ * The share of a level given to a node, and what the node produced from it.
+ */
+struct nodeShare {
+  const numaNode * node;
+  char sourceName[2][shareNameSize]; // level files, indexed by centre full
+  uint32_t first[2]; // first position of each source file in this share
+  uint32_t count[2]; // number of positions of each source file in this share
+  char destName[2][shareNameSize]; // this node's part of the next level
+  uint32_t generated[2];
+  uint32_t unique[2];
+  uint32_t * successors[2]; // statistics of the source positions of this share, filled in at the end
+  uint32_t * topBits[2]; // statistics of this node's part of the next level, filled in at the end
+  double seconds;
+};
+
+static uint32_t fileLength(FILE * f) {
+  fseek(f, 0, SEEK_END);
+  uint32_t len = ftell(f) / sizeof(uint32_t);
+  fseek(f, 0, SEEK_SET);
+  return len;
+}
+
+/*
+ * Expand, sort and uniq the share of a node, on the node's processors and with
+ * buffers from the node's arena only.
+ */
+static void * expandNodeShare(void * arg) {
+  nodeShare * share = (nodeShare *)arg;
+  pinToNode(share->node);
+  arenaUseNode(share->node->id);
+  size_t mark = arenaMark();
+  double start = wallClock();
+  uint32_t * successors[2];
+  uint32_t * topBits[2];
+  for (int full = 0; full < 2; full++) {
+    successors[full] = (uint32_t *)arenaAlloc(successorBuckets * sizeof(uint32_t));
+    topBits[full] = (uint32_t *)arenaAlloc(topBitsBuckets * sizeof(uint32_t));
+    memset(successors[full], 0, successorBuckets * sizeof(uint32_t));
+    memset(topBits[full], 0, topBitsBuckets * sizeof(uint32_t));
+  }
+  FILE * fdest[2];
+  fdest[0] = fopen(share->destName[0], modeCreateWriteBinary);
+  fdest[1] = fopen(share->destName[1], modeCreateWriteBinary);
+  for (int full = 0; full < 2; full++) {
+    FILE * fsource = fopen(share->sourceName[full], modeOpenReadBinary);
+    if (fsource == NULL)
+      continue;
+    fseek(fsource, share->first[full] * sizeof(uint32_t), SEEK_SET);
+    expandHalfLevelRange(full, fsource, share->count[full], fdest[full], fdest[1 - full], successors[full]);
+    fclose(fsource);
+  }
+  fclose(fdest[0]);
+  fclose(fdest[1]);
+  for (int full = 0; full < 2; full++) {
+    FILE * f = fopen(share->destName[full], modeOpenReadWriteBinary);
+    uint32_t len = fileLength(f);
+    bool sorted = quickFileSort(f, 0, len - 1, share->node->cpuCount, bufSize);
+    fclose(f);
+    share->generated[full] = len;
+    share->unique[full] = sorted ? longUniq(share->destName[full], topBits[full], bufSize) : uniqFailed;
+    memcpy(share->successors[full], successors[full], successorBuckets * sizeof(uint32_t));
+    memcpy(share->topBits[full], topBits[full], topBitsBuckets * sizeof(uint32_t));
+  }
+  arenaRelease(mark);
+  share->seconds = wallClock() - start;
+  return NULL;
+}
+
+/*
+ * Merge the sorted shares of all nodes into the level file.
+ * The last merge counts the top bits of the whole level.
+ * Return the length of the level, or setOpFailed, removing the shares, if a merge failed.
+ */
+static uint32_t mergeShares(nodeShare * shares, int full, const char * levelName, uint32_t * topBits) {
+  char accName[shareNameSize + 16]; // room for the merge suffix
+  char tempName[shareNameSize + 16];
+  snprintf(accName, sizeof(accName), "%s", shares[0].destName[full]);
+  uint32_t len = shares[0].unique[full];
+  if (nodeCount == 1)
+    memcpy(topBits, shares[0].topBits[full], topBitsBuckets * sizeof(uint32_t));
+  for (int n = 1; n < nodeCount; n++) {
+    snprintf(tempName, sizeof(tempName), "%s.m%d", levelName, n);
+    len = fileUnion(accName, shares[n].destName[full], false, tempName, (n == nodeCount - 1) ? topBits : NULL);
+    if (len == setOpFailed) {
+      removeLevelFile(accName);
+      for (int m = n; m < nodeCount; m++)
+        removeLevelFile(shares[m].destName[full]);
+      return setOpFailed;
+    }
+    removeLevelFile(accName);
+    removeLevelFile(shares[n].destName[full]);
+    snprintf(accName, sizeof(accName), "%s", tempName);
+  }
+  renameLevelFile(accName, levelName);
+  return len;
+}
+
+/*
+ * Expand a level into the next level, one share of the positions per NUMA node.
+ * Shares are proportional to the number of processors of each node.
+ * Return false, leaving the next level unwritten, if a node could not sort its share.
+ */
+bool expandLevelNuma(int level, bool show) {
+  if (nodeCount == 0) {
+    findNumaNodes();
+    cout << "NUMA nodes: " << nodeCount << endl;
+  }
+  nodeShare shares[maxNodes];
+  uint32_t len[2];
+  int totalCpus = 0;
+  for (int n = 0; n < nodeCount; n++)
+    totalCpus += nodes[n].cpuCount;
+  for (int full = 0; full < 2; full++) {
+    FILE * f = fopen(getName(level, full, false), modeOpenReadBinary);
+    len[full] = (f != NULL) ? fileLength(f) : 0;
+    if (f != NULL)
+      fclose(f);
+  }
+  int cpusBefore = 0;
+  size_t mark = arenaMark();
+  for (int n = 0; n < nodeCount; n++) {
+    nodeShare * share = &shares[n];
+    share->node = &nodes[n];
+    for (int full = 0; full < 2; full++) {
+      share->successors[full] = (uint32_t *)arenaAlloc(successorBuckets * sizeof(uint32_t));
+      share->topBits[full] = (uint32_t *)arenaAlloc(topBitsBuckets * sizeof(uint32_t));
+      snprintf(share->sourceName[full], shareNameSize, "%s", getName(level, full, false));
+      snprintf(share->destName[full], shareNameSize, "%s.n%d", getName(level + 1, full, false), n);
+      uint32_t from = (uint64_t)len[full] * cpusBefore / totalCpus;
+      uint32_t to = (uint64_t)len[full] * (cpusBefore + nodes[n].cpuCount) / totalCpus;
+      share->first[full] = from;
+      share->count[full] = to - from;
+    }
+    cpusBefore += nodes[n].cpuCount;
+  }
+  pthread_t threads[maxNodes];
+  for (int n = 0; n < nodeCount; n++)
+    pthread_create(&threads[n], NULL, expandNodeShare, &shares[n]);
+  for (int n = 0; n < nodeCount; n++)
+    pthread_join(threads[n], NULL);
+  bool failed = false;
+  for (int n = 0; n < nodeCount; n++) {
+    for (int full = 0; full < 2; full++) {
+      if (shares[n].unique[full] == uniqFailed) {
+        cout << "Level " << level << " node " << n << ": " << shares[n].destName[full] << " could not be sorted"
+            << endl;
+        failed = true;
+      }
+    }
+  }
+  if (failed) {
+    for (int n = 0; n < nodeCount; n++) {
+      removeLevelFile(shares[n].destName[0]);
+      removeLevelFile(shares[n].destName[1]);
+    }
+    arenaRelease(mark);
+    return false;
+  }
+  for (int n = 0; n < nodeCount; n++) {
+    nodeShare * share = &shares[n];
+    uint32_t expanded = share->count[0] + share->count[1];
+    showTime();
+    cout << "Level " << level << " node " << n << ": expanded " << expanded << " positions into "
+        << (share->generated[0] + share->generated[1]) << ", " << (share->unique[0] + share->unique[1])
+        << " unique, in " << share->seconds << " sec ("
+        << (share->seconds > 0 ? expanded / share->seconds : 0) << " positions/sec)" << endl;
+  }
+  for (int full = 0; full < 2; full++) {
+    uint32_t * successors = levelSuccessors(level, full);
+    for (int n = 0; n < nodeCount; n++) {
+      for (int i = 0; i < successorBuckets; i++)
+        successors[i] += shares[n].successors[full][i];
+    }
+    writeLevelStats(level, full);
+  }
+  for (int full = 0; full < 2; full++) {
+    char levelName[shareNameSize];
+    uint32_t generated = 0;
+    for (int n = 0; n < nodeCount; n++)
+      generated += shares[n].generated[full];
+    snprintf(levelName, sizeof(levelName), "%s", getName(level + 1, full, false));
+    clearLevelStats(level + 1, full);
+    uint32_t lu = mergeShares(shares, full, levelName, levelTopBits(level + 1, full));
+    if (lu == setOpFailed) {
+      cout << "Level " << level + 1 << (full ? " full" : " empty") << ": the node shares could not be merged" << endl;
+      if (full == 0) {
+        for (int n = 0; n < nodeCount; n++)
+          removeLevelFile(shares[n].destName[1]);
+      }
+      arenaRelease(mark);
+      return false;
+    }
+    noteLevelCounts(level + 1, full, generated, lu);
+    writeLevelStats(level + 1, full);
+    showTime();
+    cout << "Level " << level + 1 << (full ? " full" : " empty") << " uniq-ed. Length = " << lu << endl;
+    if (show)
+      showLongFile(levelName, full);
+  }
+  arenaRelease(mark);
+  return true;
+}
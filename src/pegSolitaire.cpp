@@ -7,7 +7,9 @@
 //============================================================================
 
 #include <iostream>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <stdint.h>
 using namespace std;
 
@@ -15,6 +17,22 @@ extern void prepareAllMoves ();
 void findForwardReachablePositions(int finalLevel, bool show);
 extern void retraceSteps(bool full, int level, uint32_t value);
 extern void findForwardAndBackwardRichablePositions(int level);
+extern bool numaMode;
+extern int threadCount;
+extern uint64_t memoryBudget;
+extern char * getName(int level, bool centreHoleFull, bool isTrimmed);
+extern uint32_t exportLevelFile(const char * fileName, bool full, char format, FILE * out);
+extern void setExportFilter(uint32_t mask, bool centre, int minPegs, int maxPegs);
+extern void setExportSampling(uint32_t every);
+extern void setDfsTargets(bool anySingle, const uint32_t * positions, const bool * full, int n);
+extern bool solveDepthFirst(uint32_t start, bool startFull, bool show);
+extern double dfsTimeBudget;
+extern uint32_t findPathsBetween(uint32_t start, bool startFull, const uint32_t * targets, const bool * targetsFull,
+    int nTargets, bool show);
+extern void benchmarkExpansion(int level);
+extern int verifyLevels(int firstLevel, int finalLevel);
+extern void rankLevels(int firstLevel, int finalLevel);
+extern void solveBatch(const uint32_t * starts, const bool * startsFull, int n, int finalLevel, bool show);
 
 static const int FINAL_LEVEL = 32;
 static const int MID_LEVEL = 16;
@@ -27,6 +45,15 @@ int main() {
 #endif
 
 int main (int argc, char ** args) {
+  // -t<n> anywhere on the line sets the number of threads, the default is one per processor
+  int kept = 1;
+  for (int i = 1; i < argc; i++) {
+    if (strncmp(args[i], "-t", 2) == 0)
+      threadCount = atoi(args[i] + 2);
+    else
+      args[kept++] = args[i];
+  }
+  argc = kept;
   int level;
   if (argc < 2)
     level = FINAL_LEVEL;
@@ -37,6 +64,106 @@ int main (int argc, char ** args) {
     show = false;
   else
     show = (args[2][0] == 'v');
+  if (argc >= 3 && args[2][0] == 'f') {
+    // forward expansion up to level: f[v][n] [memory budget in MB, 0 always sorts on file],
+    // v shows the positions, n uses the NUMA execution mode
+    show = (strchr(args[2], 'v') != NULL);
+    numaMode = (strchr(args[2], 'n') != NULL);
+    if (argc > 3)
+      memoryBudget = (uint64_t)(atof(args[3]) * (1 << 20));
+    findForwardReachablePositions (level, show);
+    return 0;
+  }
+  if (argc >= 3 && args[2][0] == 'd') {
+    // depth-first search for one solution: d[v] [start in hex] [start centre full 0/1] [target in hex] [target centre full 0/1]
+    // [time budget in seconds, 0 for none]
+    // the default start has only the centre hole empty, the default target is any single peg
+    uint32_t start = (argc > 3) ? strtoul(args[3], NULL, 16) : 0xFFFFFFFF;
+    bool startFull = (argc > 4) && atoi(args[4]) != 0;
+    if (argc > 5) {
+      uint32_t target = strtoul(args[5], NULL, 16);
+      bool targetFull = (argc > 6) && atoi(args[6]) != 0;
+      setDfsTargets(false, &target, &targetFull, 1);
+    }
+    if (argc > 7)
+      dfsTimeBudget = atof(args[7]);
+    return solveDepthFirst(start, startFull, strchr(args[2], 'v') != NULL) ? 0 : 1;
+  }
+  if (argc >= 3 && args[2][0] == 'b') {
+    // search from both ends: b[v] [start in hex] [start centre full 0/1] [target in hex] [target centre full 0/1] ...
+    // or b[v] [start in hex] [start centre full 0/1] any, to reach any single peg
+    uint32_t start = (argc > 3) ? strtoul(args[3], NULL, 16) : 0xFFFFFFFF;
+    bool startFull = (argc > 4) && atoi(args[4]) != 0;
+    uint32_t targets[64];
+    bool targetsFull[64];
+    int nTargets = 0;
+    if (argc <= 5 || strcmp(args[5], "any") == 0) {
+      for (int h = 0; h < 32; h++) {
+        targets[nTargets] = 1 << h;
+        targetsFull[nTargets++] = false;
+      }
+      targets[nTargets] = 0;
+      targetsFull[nTargets++] = true;
+    } else {
+      for (int a = 5; a < argc && nTargets < 64; a += 2) {
+        targets[nTargets] = strtoul(args[a], NULL, 16);
+        targetsFull[nTargets++] = (a + 1 < argc) && atoi(args[a + 1]) != 0;
+      }
+    }
+    return findPathsBetween(start, startFull, targets, targetsFull, nTargets, strchr(args[2], 'v') != NULL) > 0 ? 0 : 1;
+  }
+  if (argc >= 3 && args[2][0] == 'm') {
+    // many starts expanded together up to level: m[v] [start in hex] [start centre full 0/1] ...
+    // without starts, the 33 boards with a single empty hole
+    uint32_t starts[128];
+    bool startsFull[128];
+    int nStarts = 0;
+    if (argc <= 3) {
+      for (int h = 0; h < 32; h++) {
+        starts[nStarts] = ~(1u << h);
+        startsFull[nStarts++] = true;
+      }
+      starts[nStarts] = 0xFFFFFFFF;
+      startsFull[nStarts++] = false;
+    } else {
+      for (int a = 3; a < argc && nStarts < 128; a += 2) {
+        starts[nStarts] = strtoul(args[a], NULL, 16);
+        startsFull[nStarts++] = (a + 1 < argc) && atoi(args[a + 1]) != 0;
+      }
+    }
+    solveBatch(starts, startsFull, nStarts, level, strchr(args[2], 'v') != NULL);
+    return 0;
+  }
+  if (argc >= 3 && args[2][0] == 'c') {
+    // check the level files from 1 up to level against their recorded checksums: c
+    return verifyLevels(1, level) == 0 ? 0 : 1;
+  }
+  if (argc >= 3 && args[2][0] == 'r') {
+    // write the rank form of the level files from 1 up to level: r
+    rankLevels(1, level);
+    return 0;
+  }
+  if (argc >= 3 && args[2][0] == 'k') {
+    // compare the expansion kernels on the positions of level: k
+    benchmarkExpansion(level);
+    return 0;
+  }
+  if (argc >= 3 && args[2][0] == 'x') {
+    // export a level: x[t|c|b] [sample every] [region mask, bit 32 is the centre] [min pegs] [max pegs]
+    char format = (args[2][1] != 0) ? args[2][1] : 't';
+    if (argc > 3)
+      setExportSampling(strtoul(args[3], NULL, 10));
+    if (argc > 4) {
+      unsigned long long region = strtoull(args[4], NULL, 16);
+      setExportFilter((uint32_t)region, (region >> 32) != 0,
+          (argc > 5) ? atoi(args[5]) : 0, (argc > 6) ? atoi(args[6]) : 33);
+    }
+    if (format == 'c')
+      fputs("position,centre,pegs,rows\n", stdout);
+    exportLevelFile(getName(level, false, false), false, format, stdout);
+    exportLevelFile(getName(level, true, false), true, format, stdout);
+    return 0;
+  }
 #if 0
   prepareAllMoves();
   if (argc < 3 || args[2][0] != 'e')
@@ -0,0 +1,445 @@
+/*
+ * rankCodec.cpp
+ *
+ * Ranking of positions among the positions with the same number of pegs.
+ * All the positions of a half level have the same number k of pegs in holes 0-31,
+ * so each can be replaced by its index among the C(32, k) masks with k bits set.
+ * The index used is the colex rank: for the set bits i1 < i2 < ... < ik it is
+ * C(i1, 1) + C(i2, 2) + ... + C(ik, k), which orders masks as numbers, so a sorted
+ * level file gives sorted ranks.
+ * A half level is stored in a .rnk file either as a bitmap over the ranks, when it
+ * holds a large part of the possible positions, or as its sorted ranks, delta coded:
+ * the ranks are split in groups, the first rank of each group is kept whole in an
+ * index and the others as varint differences from the rank before them.
+ * A form that would not be smaller than the level file itself is not written.
+ * The .rnk file carries the digest of the level file's checksums, so a rank form
+ * left over from an earlier version of the level is not used.
+ */
+#include <iostream>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <algorithm>
+using namespace std;
+
+extern const char * modeCreateWriteBinary;
+extern const char * modeOpenReadBinary;
+extern char * getName(int level, bool centreHoleFull, bool isTrimmed);
+extern bool levelFileDigest(const char * fileName, uint64_t * digest);
+extern bool checkNamedLevelFile(const char * fileName, int level, bool full, bool verifySums);
+extern void * arenaAlloc(size_t bytes);
+extern size_t arenaMark();
+extern void arenaRelease(size_t mark);
+
+static const int NO_OF_HOLES = 33;
+static const uint32_t rankFileMagic = 0x324b4750; // "PGK2"
+static const uint32_t rankGroupSize = 64; // ranks per index entry of the delta coded form
+static const int rankNameSize = 96;
+static const int maxRankedLevels = 4 * (NO_OF_HOLES + 1); // room for a few prefixes
+
+/*
+ * binomial[n][k] is C(n, k) for n up to 32.
+ * byteRank[b][v][c] is the part of the rank given by byte b of a mask when it is v
+ * and the lower bytes have c bits set, so a rank takes four table lookups.
+ */
+static uint32_t binomial[33][34];
+static uint32_t byteRank[4][256][33];
+static bool rankTablesReady = false;
+
+static void prepareRankTables() {
+  memset(binomial, 0, sizeof(binomial));
+  for (int n = 0; n <= 32; n++) {
+    binomial[n][0] = 1;
+    for (int k = 1; k <= n; k++)
+      binomial[n][k] = binomial[n - 1][k - 1] + (k <= n - 1 ? binomial[n - 1][k] : 0);
+  }
+  for (int b = 0; b < 4; b++) {
+    for (int v = 0; v < 256; v++) {
+      for (int c = 0; c <= 32; c++) {
+        uint32_t r = 0;
+        int t = c;
+        for (int p = 0; p < 8; p++) {
+          if (v & (1 << p)) {
+            t++;
+            if (t <= 32)
+              r += binomial[8 * b + p][t];
+          }
+        }
+        byteRank[b][v][c] = r;
+      }
+    }
+  }
+  rankTablesReady = true;
+}
+
+/*
+ * Number of masks with k bits set.
+ */
+uint32_t rankCount(int k) {
+  if (!rankTablesReady)
+    prepareRankTables();
+  return (k >= 0 && k <= 32) ? binomial[32][k] : 0;
+}
+
+/*
+ * Colex rank of a mask among the masks with as many bits set.
+ */
+uint32_t rankPosition(uint32_t pos) {
+  if (!rankTablesReady)
+    prepareRankTables();
+  uint32_t b0 = pos & 0xFF, b1 = (pos >> 8) & 0xFF, b2 = (pos >> 16) & 0xFF, b3 = pos >> 24;
+  int c1 = __builtin_popcount(b0);
+  int c2 = c1 + __builtin_popcount(b1);
+  int c3 = c2 + __builtin_popcount(b2);
+  return byteRank[0][b0][0] + byteRank[1][b1][c1] + byteRank[2][b2][c2] + byteRank[3][b3][c3];
+}
+
+/*
+ * The mask with k bits set of the given rank: from the top hole down, a hole has a
+ * peg when the rank is at least the number of masks with k bits in the holes below it.
+ */
+uint32_t unrankPosition(uint32_t rank, int k) {
+  if (!rankTablesReady)
+    prepareRankTables();
+  uint32_t pos = 0;
+  for (int i = 31; i >= 0 && k > 0; i--) {
+    if (binomial[i][k] <= rank) {
+      rank -= binomial[i][k];
+      pos |= 1u << i;
+      k--;
+    }
+  }
+  return pos;
+}
+
+/*
+ * A half level held in memory in rank form.
+ */
+struct rankedLevel {
+  int k; // pegs in holes 0-31
+  bool dense;
+  uint32_t count;
+  uint32_t * data; // bitmap of rankCount(k) bits, or the first rank of each group
+  uint32_t * offsets; // where the differences of each group start in bytes
+  uint8_t * bytes; // the varint differences
+};
+
+struct rankFileHeader {
+  uint32_t magic;
+  uint32_t level;
+  uint32_t full;
+  uint32_t k;
+  uint32_t dense;
+  uint32_t count;
+  uint32_t bytes; // size of the varint differences
+  uint32_t groupSize;
+  uint64_t digest; // of the checksums of the level file, see levelFileDigest
+};
+
+static char * getRankName(const char * fileName) {
+  static char name[rankNameSize];
+  snprintf(name, sizeof(name) - 4, "%s", fileName);
+  char * dot = strrchr(name, '.');
+  strcpy((dot != NULL) ? dot : name + strlen(name), ".rnk");
+  return name;
+}
+
+static int pegsInMask(int level, bool full) {
+  return NO_OF_HOLES - level - (full ? 1 : 0);
+}
+
+/*
+ * Bytes taken by the varint coding of a value.
+ */
+static uint32_t varintSize(uint32_t v) {
+  uint32_t n = 1;
+  while (v >= 0x80) {
+    v >>= 7;
+    n++;
+  }
+  return n;
+}
+
+static uint8_t * putVarint(uint8_t * p, uint32_t v) {
+  while (v >= 0x80) {
+    *p++ = (uint8_t)(v | 0x80);
+    v >>= 7;
+  }
+  *p++ = (uint8_t)v;
+  return p;
+}
+
+static const uint8_t * getVarint(const uint8_t * p, uint32_t * v) {
+  uint32_t r = 0;
+  int shift = 0;
+  while (*p & 0x80) {
+    r |= (uint32_t)(*p++ & 0x7F) << shift;
+    shift += 7;
+  }
+  *v = r | ((uint32_t)*p++ << shift);
+  return p;
+}
+
+/*
+ * Rank forms looked up so far, by level file name, NULL for a level without a usable one.
+ * They are kept for the rest of the run, across the marks the levels are released to,
+ * so they are allocated outside the arena.
+ */
+struct rankedEntry {
+  char name[rankNameSize];
+  rankedLevel * level;
+};
+
+static rankedEntry rankedLevels[maxRankedLevels];
+static int nRankedLevels = 0;
+
+static rankedEntry * findRankedEntry(const char * fileName) {
+  for (int i = 0; i < nRankedLevels; i++) {
+    if (strcmp(rankedLevels[i].name, fileName) == 0)
+      return &rankedLevels[i];
+  }
+  return NULL;
+}
+
+static void freeRankedLevel(rankedLevel * rl) {
+  if (rl == NULL)
+    return;
+  free(rl->data);
+  free(rl->offsets);
+  free(rl->bytes);
+  delete rl;
+}
+
+/*
+ * Write the rank form of a half level file, in whichever form is smaller, unless it
+ * would not be smaller than the file. Return the size of the rank file in bytes,
+ * 0 if none was written, and set *dense if the form written is a bitmap.
+ */
+uint64_t writeRankedLevel(int level, bool full, bool * dense) {
+  char fileName[rankNameSize];
+  snprintf(fileName, sizeof(fileName), "%s", getName(level, full, false));
+  rankedEntry * e = findRankedEntry(fileName);
+  if (e != NULL) { // looked up before this form was written
+    freeRankedLevel(e->level);
+    *e = rankedLevels[--nRankedLevels];
+  }
+  remove(getRankName(fileName));
+  *dense = false;
+  rankFileHeader h;
+  if (!levelFileDigest(fileName, &h.digest)) { // written before checksums were recorded
+    if (!checkNamedLevelFile(fileName, level, full, false) || !levelFileDigest(fileName, &h.digest)) {
+      cout << fileName << " is not ranked" << endl;
+      return 0;
+    }
+  }
+  FILE * f = fopen(fileName, modeOpenReadBinary);
+  if (f == NULL) {
+    cout << "cannot open file " << fileName << endl;
+    return 0;
+  }
+  fseek(f, 0, SEEK_END);
+  h.magic = rankFileMagic;
+  h.level = level;
+  h.full = full ? 1 : 0;
+  h.k = pegsInMask(level, full);
+  h.count = ftell(f) / sizeof(uint32_t);
+  h.bytes = 0;
+  h.groupSize = rankGroupSize;
+  fseek(f, 0, SEEK_SET);
+  uint32_t space = rankCount(h.k);
+  uint32_t words = space / 32 + 1;
+  uint32_t groups = (h.count + rankGroupSize - 1) / rankGroupSize;
+  // the differences average space / count
+  uint64_t sparseEstimate = (uint64_t)h.count * varintSize(space / (h.count + 1)) + 2 * groups * sizeof(uint32_t);
+  h.dense = ((uint64_t)words * sizeof(uint32_t) < sparseEstimate) ? 1 : 0;
+  FILE * fw = fopen(getRankName(fileName), modeCreateWriteBinary);
+  fwrite(&h, sizeof(h), 1, fw);
+  const uint32_t readSize = 1 << 16;
+  size_t mark = arenaMark();
+  uint32_t * rbuf = (uint32_t *)arenaAlloc(readSize * sizeof(uint32_t));
+  uint8_t * cbuf = (uint8_t *)arenaAlloc(readSize * 5);
+  uint32_t * bitmap = NULL;
+  uint32_t * firsts = NULL;
+  uint32_t * offsets = NULL;
+  if (h.dense) {
+    bitmap = (uint32_t *)arenaAlloc(words * sizeof(uint32_t));
+    memset(bitmap, 0, words * sizeof(uint32_t));
+  } else {
+    firsts = (uint32_t *)arenaAlloc((groups + 1) * sizeof(uint32_t));
+    offsets = (uint32_t *)arenaAlloc((groups + 1) * sizeof(uint32_t));
+    fseek(fw, 2 * groups * sizeof(uint32_t), SEEK_CUR); // room for the index, written at the end
+  }
+  uint32_t rc;
+  uint32_t n = 0;
+  uint32_t prev = 0;
+  while ((rc = fread(rbuf, sizeof(uint32_t), readSize, f)) > 0) {
+    uint8_t * p = cbuf;
+    for (uint32_t i = 0; i < rc; i++, n++) {
+      uint32_t r = rankPosition(rbuf[i]);
+      if (h.dense) {
+        bitmap[r >> 5] |= 1u << (r & 31);
+      } else if (n % rankGroupSize == 0) {
+        firsts[n / rankGroupSize] = r;
+        offsets[n / rankGroupSize] = h.bytes + (p - cbuf);
+      } else {
+        p = putVarint(p, r - prev);
+      }
+      prev = r;
+    }
+    if (!h.dense) {
+      fwrite(cbuf, 1, p - cbuf, fw);
+      h.bytes += p - cbuf;
+    }
+  }
+  uint64_t size = sizeof(h);
+  if (h.dense) {
+    fwrite(bitmap, sizeof(uint32_t), words, fw);
+    size += (uint64_t)words * sizeof(uint32_t);
+  } else {
+    fseek(fw, 0, SEEK_SET);
+    fwrite(&h, sizeof(h), 1, fw);
+    fwrite(firsts, sizeof(uint32_t), groups, fw);
+    fwrite(offsets, sizeof(uint32_t), groups, fw);
+    size += 2 * (uint64_t)groups * sizeof(uint32_t) + h.bytes;
+  }
+  arenaRelease(mark);
+  fclose(fw);
+  fclose(f);
+  if (size >= (uint64_t)h.count * sizeof(uint32_t)) {
+    remove(getRankName(fileName));
+    return 0;
+  }
+  *dense = (h.dense != 0);
+  return size;
+}
+
+/*
+ * Read the rank form of a level file, or return NULL if it has none, or one written
+ * from other contents of the file than its current ones.
+ */
+static rankedLevel * readRankedLevel(const char * fileName, int level, bool full) {
+  FILE * f = fopen(getRankName(fileName), modeOpenReadBinary);
+  if (f == NULL)
+    return NULL;
+  rankFileHeader h;
+  if (fread(&h, sizeof(h), 1, f) != 1 || h.magic != rankFileMagic || (int)h.level != level
+      || h.k != (uint32_t)pegsInMask(level, full) || h.groupSize != rankGroupSize) {
+    cout << "bad rank file " << getRankName(fileName) << endl;
+    fclose(f);
+    return NULL;
+  }
+  uint64_t digest;
+  if (!levelFileDigest(fileName, &digest) || digest != h.digest) {
+    // the level was rebuilt after its rank form was written
+    fclose(f);
+    return NULL;
+  }
+  rankedLevel * rl = new rankedLevel;
+  rl->k = h.k;
+  rl->dense = (h.dense != 0);
+  rl->count = h.count;
+  rl->offsets = NULL;
+  rl->bytes = NULL;
+  uint32_t words = rl->dense ? rankCount(h.k) / 32 + 1 : (h.count + rankGroupSize - 1) / rankGroupSize;
+  rl->data = (uint32_t *)malloc(((size_t)words + 1) * sizeof(uint32_t));
+  bool complete = (fread(rl->data, sizeof(uint32_t), words, f) == words);
+  if (!rl->dense) {
+    rl->offsets = (uint32_t *)malloc(((size_t)words + 1) * sizeof(uint32_t));
+    rl->bytes = (uint8_t *)malloc((size_t)h.bytes + 1);
+    complete = complete && fread(rl->offsets, sizeof(uint32_t), words, f) == words
+        && fread(rl->bytes, 1, h.bytes, f) == h.bytes;
+  }
+  fclose(f);
+  if (!complete) {
+    cout << "rank file " << getRankName(fileName) << " is short" << endl;
+    freeRankedLevel(rl);
+    return NULL;
+  }
+  return rl;
+}
+
+/*
+ * Return the rank form of a half level, loading it at first use,
+ * or NULL if the level has no usable rank file.
+ */
+static const rankedLevel * getRankedLevel(int level, bool full) {
+  const char * fileName = getName(level, full, false);
+  rankedEntry * e = findRankedEntry(fileName);
+  if (e != NULL)
+    return e->level;
+  rankedLevel * rl = readRankedLevel(fileName, level, full);
+  if (nRankedLevels < maxRankedLevels) {
+    e = &rankedLevels[nRankedLevels++];
+    snprintf(e->name, sizeof(e->name), "%s", getName(level, full, false));
+    e->level = rl;
+  }
+  return rl;
+}
+
+/*
+ * Find a rank in the delta coded form: a binary search in the index of groups,
+ * then the differences of one group are added up.
+ */
+static bool rankInGroups(const rankedLevel * rl, uint32_t r) {
+  uint32_t groups = (rl->count + rankGroupSize - 1) / rankGroupSize;
+  uint32_t g = upper_bound(rl->data, rl->data + groups, r) - rl->data;
+  if (g == 0)
+    return false;
+  g--;
+  uint32_t v = rl->data[g];
+  uint32_t left = min(rankGroupSize, rl->count - g * rankGroupSize) - 1;
+  const uint8_t * p = rl->bytes + rl->offsets[g];
+  while (v < r && left-- > 0) {
+    uint32_t d;
+    p = getVarint(p, &d);
+    v += d;
+  }
+  return v == r;
+}
+
+/*
+ * Look a position up in the rank form of its half level: one bit test for a bitmap,
+ * a search of the index and of one group for delta coded ranks.
+ * Set *found and return true if the level has a rank file, else return false.
+ */
+bool rankedValueFound(int level, bool full, uint32_t value, bool * found) {
+  const rankedLevel * rl = getRankedLevel(level, full);
+  if (rl == NULL)
+    return false;
+  if (__builtin_popcount(value) != rl->k) {
+    *found = false;
+  } else {
+    uint32_t r = rankPosition(value);
+    if (rl->dense)
+      *found = (rl->data[r >> 5] >> (r & 31)) & 1;
+    else
+      *found = rankInGroups(rl, r);
+  }
+  return true;
+}
+
+/*
+ * Write the rank form of both halves of levels firstLevel to finalLevel,
+ * and show how much smaller it is than the level files.
+ */
+void rankLevels(int firstLevel, int finalLevel) {
+  for (int level = firstLevel; level <= finalLevel; level++) {
+    for (int full = 0; full < 2; full++) {
+      FILE * f = fopen(getName(level, full, false), modeOpenReadBinary);
+      if (f == NULL)
+        continue;
+      fseek(f, 0, SEEK_END);
+      uint64_t raw = ftell(f);
+      fclose(f);
+      bool dense;
+      uint64_t ranked = writeRankedLevel(level, full, &dense);
+      cout << getName(level, full, false) << ": " << raw / sizeof(uint32_t) << " positions of "
+          << rankCount(pegsInMask(level, full)) << ", " << raw << " bytes as masks, ";
+      if (ranked == 0)
+        cout << "kept as masks" << endl;
+      else
+        cout << ranked << " bytes as " << (dense ? "bitmap" : "delta coded ranks") << endl;
+    }
+  }
+}
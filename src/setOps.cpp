@@ -0,0 +1,366 @@
+/*
+ * setOps.cpp
+ *
+ * Set algebra on sets of positions stored as ascending sequences of
+ * unique uint32_t, either in memory or in level files.
+ */
+#include <iostream>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <algorithm>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+using namespace std;
+
+extern const char * modeCreateWriteBinary;
+extern const char * modeOpenReadBinary;
+extern void * arenaAlloc(size_t bytes);
+extern size_t arenaMark();
+extern void arenaRelease(size_t mark);
+struct levelSums;
+extern levelSums * startLevelSums();
+extern void addLevelSums(levelSums * s, const uint32_t * values, uint32_t n);
+extern void finishLevelSums(levelSums * s, const char * fileName);
+
+/*
+ * Returned by the set operations on files when an input cannot be opened or the
+ * result cannot be created, in which case no result file is left.
+ */
+extern const uint32_t setOpFailed = (uint32_t)-1;
+
+static const int SET_INTERSECTION = 0;
+static const int SET_DIFFERENCE = 1;
+static const int SET_UNION = 2;
+
+/*
+ * Number of elements held in memory for each input of a file operation.
+ */
+static const uint32_t setBufSize = 1 << 18;
+
+/*
+ * Above this ratio between the sizes of the two inputs the smaller set is
+ * looked up in the larger one by galloping instead of merging.
+ */
+static const uint32_t gallopRatio = 32;
+
+/*
+ * Find the first element not lower than 'value' in b[j..nb), probing at
+ * exponentially growing distances from j and then binary searching.
+ */
+static uint32_t gallop(const uint32_t * b, uint32_t j, uint32_t nb, uint32_t value) {
+  uint32_t step = 1;
+  uint32_t lo = j;
+  uint32_t hi = j;
+  while (hi < nb && b[hi] < value) {
+    lo = hi + 1;
+    hi += step;
+    step <<= 1;
+  }
+  if (hi > nb)
+    hi = nb;
+  return lower_bound(b + lo, b + hi, value) - b;
+}
+
+#ifdef __SSE2__
+/*
+ * Compare the four elements at a with the four elements at b, all against all.
+ * Bit k of the result is set if a[k] is equal to any of b[0..3].
+ */
+static inline int blockMatch(const uint32_t * a, const uint32_t * b) {
+  __m128i va = _mm_loadu_si128((const __m128i *)a);
+  __m128i vb = _mm_loadu_si128((const __m128i *)b);
+  __m128i c = _mm_cmpeq_epi32(va, vb);
+  vb = _mm_shuffle_epi32(vb, _MM_SHUFFLE(0, 3, 2, 1));
+  c = _mm_or_si128(c, _mm_cmpeq_epi32(va, vb));
+  vb = _mm_shuffle_epi32(vb, _MM_SHUFFLE(0, 3, 2, 1));
+  c = _mm_or_si128(c, _mm_cmpeq_epi32(va, vb));
+  vb = _mm_shuffle_epi32(vb, _MM_SHUFFLE(0, 3, 2, 1));
+  c = _mm_or_si128(c, _mm_cmpeq_epi32(va, vb));
+  return _mm_movemask_ps(_mm_castsi128_ps(c));
+}
+#endif
+
+/*
+ * Store in out the elements of a that are also in b, return their number.
+ */
+uint32_t intersectSets(const uint32_t * a, uint32_t na, const uint32_t * b, uint32_t nb, uint32_t * out) {
+  if (na > nb) {
+    const uint32_t * t = a; a = b; b = t;
+    uint32_t n = na; na = nb; nb = n;
+  }
+  uint32_t i = 0, j = 0, n = 0;
+  if ((uint64_t)na * gallopRatio < nb) {
+    while (i < na && j < nb) {
+      j = gallop(b, j, nb, a[i]);
+      if (j < nb && b[j] == a[i])
+        out[n++] = a[i];
+      i++;
+    }
+    return n;
+  }
+#ifdef __SSE2__
+  while (i + 4 <= na && j + 4 <= nb) {
+    int m = blockMatch(a + i, b + j);
+    while (m) {
+      out[n++] = a[i + __builtin_ctz(m)];
+      m &= m - 1;
+    }
+    uint32_t amax = a[i + 3];
+    uint32_t bmax = b[j + 3];
+    if (amax <= bmax) i += 4;
+    if (bmax <= amax) j += 4;
+  }
+#endif
+  while (i < na && j < nb) {
+    uint32_t av = a[i], bv = b[j];
+    out[n] = av;
+    n += (av == bv);
+    i += (av <= bv);
+    j += (bv <= av);
+  }
+  return n;
+}
+
+/*
+ * Store in out the elements of a that are not in b, return their number.
+ */
+uint32_t differenceSets(const uint32_t * a, uint32_t na, const uint32_t * b, uint32_t nb, uint32_t * out) {
+  uint32_t i = 0, j = 0, n = 0;
+  if ((uint64_t)na * gallopRatio < nb) {
+    while (i < na) {
+      j = gallop(b, j, nb, a[i]);
+      if (j >= nb || b[j] != a[i])
+        out[n++] = a[i];
+      i++;
+    }
+    return n;
+  }
+  int found = 0; // elements of the block at a+i already seen in b
+#ifdef __SSE2__
+  while (i + 4 <= na && j + 4 <= nb) {
+    found |= blockMatch(a + i, b + j);
+    uint32_t amax = a[i + 3];
+    uint32_t bmax = b[j + 3];
+    if (amax <= bmax) {
+      for (int k = 0; k < 4; k++) {
+        out[n] = a[i + k];
+        n += ((found >> k) & 1) ^ 1;
+      }
+      found = 0;
+      i += 4;
+    }
+    if (bmax <= amax) j += 4;
+  }
+#endif
+  while (i < na && j < nb) {
+    uint32_t av = a[i], bv = b[j];
+    if (av <= bv) {
+      out[n] = av;
+      n += (av != bv) & ((found & 1) ^ 1);
+      found >>= 1;
+      i++;
+    }
+    j += (bv <= av);
+  }
+  while (i < na) {
+    out[n] = a[i++];
+    n += (found & 1) ^ 1;
+    found >>= 1;
+  }
+  return n;
+}
+
+/*
+ * Store in out the elements that are in a or in b, return their number.
+ */
+uint32_t unionSets(const uint32_t * a, uint32_t na, const uint32_t * b, uint32_t nb, uint32_t * out) {
+  uint32_t i = 0, j = 0, n = 0;
+  while (i < na && j < nb) {
+    uint32_t av = a[i], bv = b[j];
+    out[n++] = (av <= bv) ? av : bv;
+    i += (av <= bv);
+    j += (bv <= av);
+  }
+  while (i < na)
+    out[n++] = a[i++];
+  while (j < nb)
+    out[n++] = b[j++];
+  return n;
+}
+
+static uint32_t applySetOperation(int op, const uint32_t * a, uint32_t na, const uint32_t * b, uint32_t nb, uint32_t * out) {
+  switch (op) {
+  case SET_INTERSECTION:
+    return intersectSets(a, na, b, nb, out);
+  case SET_DIFFERENCE:
+    return differenceSets(a, na, b, nb, out);
+  default:
+    return unionSets(a, na, b, nb, out);
+  }
+}
+
+/*
+ * Buffered sequential reader of a level file.
+ * A complemented reader reads the file from the end and returns the complement
+ * of each position, which turns a descending sequence into an ascending one.
+ */
+struct setReader {
+  FILE * f;
+  bool complement;
+  uint32_t * buf;
+  uint32_t start; // first element not yet consumed in buf
+  uint32_t count; // elements in buf after start
+  uint32_t unread; // elements left in the file
+};
+
+static bool openReader(setReader * r, const char * fileName, bool complement) {
+  r->f = fopen(fileName, modeOpenReadBinary);
+  if (r->f == NULL) {
+    cout << "cannot open file " << fileName << endl;
+    return false;
+  }
+  fseek(r->f, 0, SEEK_END);
+  r->unread = ftell(r->f) / sizeof(uint32_t);
+  fseek(r->f, 0, SEEK_SET);
+  r->complement = complement;
+  r->buf = (uint32_t *)arenaAlloc(setBufSize * sizeof(uint32_t));
+  r->start = 0;
+  r->count = 0;
+  return true;
+}
+
+static void closeReader(setReader * r) {
+  fclose(r->f);
+}
+
+/*
+ * Move the unconsumed elements to the front of the buffer and fill the rest
+ * from the file.
+ */
+static void refill(setReader * r) {
+  if (r->start > 0) {
+    memmove(r->buf, r->buf + r->start, r->count * sizeof(uint32_t));
+    r->start = 0;
+  }
+  uint32_t c = setBufSize - r->count;
+  if (c > r->unread)
+    c = r->unread;
+  if (c == 0)
+    return;
+  uint32_t * dest = r->buf + r->count;
+  if (r->complement) {
+    fseek(r->f, (r->unread - c) * sizeof(uint32_t), SEEK_SET);
+    c = fread(dest, sizeof(uint32_t), c, r->f);
+    reverse(dest, dest + c);
+    for (uint32_t k = 0; k < c; k++)
+      dest[k] = ~dest[k];
+  } else {
+    c = fread(dest, sizeof(uint32_t), c, r->f);
+  }
+  r->count += c;
+  r->unread -= c;
+}
+
+/*
+ * Apply a set operation to two level files and write the result to a third.
+ * Both inputs are consumed in blocks: the part of each block up to the lower
+ * of the two last values can be processed without looking further ahead.
+ * If topBits is not NULL the result is also counted by its top 8 bits.
+ * The checksums of the result are recorded with it.
+ * Return the number of positions written, or setOpFailed.
+ */
+static uint32_t fileSetOperation(int op, const char * aName, const char * bName, bool complementB, const char * outName,
+    uint32_t * topBits) {
+  setReader a, b;
+  size_t mark = arenaMark();
+  if (!openReader(&a, aName, false)) {
+    arenaRelease(mark);
+    return setOpFailed;
+  }
+  if (!openReader(&b, bName, complementB)) {
+    closeReader(&a);
+    arenaRelease(mark);
+    return setOpFailed;
+  }
+  FILE * fw = fopen(outName, modeCreateWriteBinary);
+  if (fw == NULL) {
+    cout << "cannot create file " << outName << endl;
+    closeReader(&a);
+    closeReader(&b);
+    arenaRelease(mark);
+    return setOpFailed;
+  }
+  uint32_t * out = (uint32_t *)arenaAlloc(2 * setBufSize * sizeof(uint32_t));
+  levelSums * sums = startLevelSums();
+  uint32_t total = 0;
+  while (1) {
+    refill(&a);
+    refill(&b);
+    if (a.count == 0 && b.count == 0)
+      break;
+    const uint32_t * ap = a.buf + a.start;
+    const uint32_t * bp = b.buf + b.start;
+    uint32_t ca = a.count;
+    uint32_t cb = b.count;
+    if (ca > 0 && cb > 0) {
+      uint32_t limit = min(ap[ca - 1], bp[cb - 1]);
+      ca = upper_bound(ap, ap + ca, limit) - ap;
+      cb = upper_bound(bp, bp + cb, limit) - bp;
+    } else if (op == SET_INTERSECTION) {
+      break;
+    }
+    uint32_t n = applySetOperation(op, ap, ca, bp, cb, out);
+    if (n > 0) {
+      fwrite(out, sizeof(uint32_t), n, fw);
+      addLevelSums(sums, out, n);
+      total += n;
+      if (topBits != NULL) {
+        for (uint32_t k = 0; k < n; k++)
+          topBits[out[k] >> 24]++;
+      }
+    }
+    a.start += ca;
+    a.count -= ca;
+    b.start += cb;
+    b.count -= cb;
+  }
+  fclose(fw);
+  finishLevelSums(sums, outName);
+  closeReader(&a);
+  closeReader(&b);
+  arenaRelease(mark);
+  return total;
+}
+
+/*
+ * Write to outName the positions of file aName that are also in file bName,
+ * or in the complement of file bName. Return the number of positions written,
+ * also counted by top 8 bits in topBits unless it is NULL, or setOpFailed.
+ */
+uint32_t fileIntersection(const char * aName, const char * bName, bool complementB, const char * outName,
+    uint32_t * topBits) {
+  return fileSetOperation(SET_INTERSECTION, aName, bName, complementB, outName, topBits);
+}
+
+/*
+ * Write to outName the positions of file aName that are not in file bName,
+ * or not in the complement of file bName. Return the number of positions written,
+ * also counted by top 8 bits in topBits unless it is NULL, or setOpFailed.
+ */
+uint32_t fileDifference(const char * aName, const char * bName, bool complementB, const char * outName,
+    uint32_t * topBits) {
+  return fileSetOperation(SET_DIFFERENCE, aName, bName, complementB, outName, topBits);
+}
+
+/*
+ * Write to outName the positions that are in file aName or in file bName,
+ * or in the complement of file bName. Return the number of positions written,
+ * also counted by top 8 bits in topBits unless it is NULL, or setOpFailed.
+ */
+uint32_t fileUnion(const char * aName, const char * bName, bool complementB, const char * outName,
+    uint32_t * topBits) {
+  return fileSetOperation(SET_UNION, aName, bName, complementB, outName, topBits);
+}